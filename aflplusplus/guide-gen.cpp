@@ -2,8 +2,6 @@ extern "C" {
 #include "afl-fuzz.h"
 }
 
-#include <sstream>
-
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +24,25 @@ struct my_mutator {
 
 std::string Prefix, Generator, ExtraCommand;
 
+// hand the generator its choices in the binary format
+bool BinaryChoices = false;
+
+// set when the generator runs as a persistent process
+std::unique_ptr<tree_guide::GeneratorProcess> Persistent;
+
+// set when the generator runs in this process, as a plugin
+std::unique_ptr<tree_guide::GeneratorPlugin> Plugin;
+std::string PluginOutput;
+
+// reused across calls so that its storage is too
+tree_guide::FileGuide FG;
+
+// holds the choices of the second test case, to splice from
+tree_guide::FileGuide SpliceFG;
+
+// splice scopes in from the second test case that AFL++ hands us
+bool Splice = true;
+
 static std::string getEnvVar(std::string const &var) {
   char const *val = getenv(var.c_str());
   return (val == nullptr) ? std::string() : std::string(val);
@@ -35,6 +52,10 @@ extern "C" my_mutator *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   mutator::init(seed);
 
   ExtraCommand = getEnvVar("FILEGUIDE_EXTRA_COMMAND");
+  BinaryChoices = !getEnvVar("FILEGUIDE_BINARY_CHOICES").empty();
+  Splice = getEnvVar("FILEGUIDE_NO_SPLICE").empty();
+  // a donor that doesn't parse is skipped, so it's not worth a message
+  SpliceFG.setQuiet(true);
 
   Prefix = getEnvVar("FILEGUIDE_COMMENT_PREFIX");
   if (Prefix.empty()) {
@@ -43,13 +64,21 @@ extern "C" my_mutator *afl_custom_init(afl_state_t *afl, unsigned int seed) {
     exit(-1);
   }
 
+  auto PluginPath = getEnvVar("FILEGUIDE_PLUGIN");
+  if (!PluginPath.empty())
+    Plugin = std::make_unique<tree_guide::GeneratorPlugin>(PluginPath);
+
   Generator = getEnvVar("FILEGUIDE_GENERATOR");
-  if (Generator.empty()) {
+  if (Generator.empty() && !Plugin) {
     std::cerr << "\nERROR: Expected full path to generator in env var called "
                  "FILEGUIDE_GENERATOR\n\n";
     exit(-1);
   }
 
+  if (!Plugin && !getEnvVar("FILEGUIDE_PERSISTENT").empty())
+    Persistent =
+        std::make_unique<tree_guide::GeneratorProcess>(Generator, MAX_FILE);
+
   my_mutator *data = (my_mutator *)calloc(1, sizeof(my_mutator));
   if (!data) {
     perror("afl_custom_init alloc");
@@ -75,6 +104,43 @@ extern "C" my_mutator *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   return data;
 }
 
+// run the extra command, if there is one, on a generated test case
+static void runExtraCommand(const std::string &FileName) {
+  if (ExtraCommand.empty())
+    return;
+  auto pid2 = fork();
+  if (pid2 == -1) {
+    std::cerr << "ERROR: fork failed\n";
+    exit(-1);
+  }
+  if (pid2 == 0) {
+    // child
+
+    // it seems like it would be a nice thing to do to shut down the
+    // shared memory window before we exec the outside code, but
+    // this function invocation crashes, for whatever reason
+    // afl_shm_deinit(&data->afl->shm);
+
+    auto res = execl(ExtraCommand.c_str(), ExtraCommand.c_str(), FileName.c_str(), (char *)nullptr);
+    // of course this line normally does not execute
+    exit(res);
+  }
+  // wait for the child process -- this keeps total machine load to
+  // a predictable factor and also prevents the plugin from removing
+  // the temp file while the second child is still looking at it
+  int wstatus;
+  waitpid(pid2, &wstatus, 0);
+  if (!WIFEXITED(wstatus)) {
+    std::cerr << "ERROR: child2 exited abnormally\n";
+    exit(-1);
+  }
+  auto ret = WEXITSTATUS(wstatus);
+  if (ret != 0) {
+    std::cerr << "ERROR: child2 did not return 0\n";
+    exit(-1);
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 /**
@@ -98,24 +164,56 @@ extern "C" size_t afl_custom_fuzz(my_mutator *data, uint8_t *buf,
                                   uint8_t *add_buf,
                                   size_t add_buf_size, // add_buf can be NULL
                                   size_t max_size) {
-  std::string Str((char *)buf, buf_size);
-  std::stringstream SS(Str);
-  tree_guide::FileGuide FG;
   //FG.setSync(tree_guide::Sync::RESYNC);
   FG.setSync(tree_guide::Sync::NONE);
-  if (!FG.parseChoices(SS, Prefix)) {
+  // parse and mutate in place, so that nothing else touches the choices
+  // on their way to a persistent or plugin generator
+  auto &C1 = FG.getChoices();
+  C1.clear();
+  if (!FG.parseChoices((const char *)buf, buf_size, Prefix)) {
     std::cerr << "ERROR: couldn't parse choices from:\n";
-    std::cerr << SS.str();
+    std::cerr.write((const char *)buf, buf_size);
     std::cerr << "--------------------------\n\n";
     exit(-1);
   }
-  auto C1 = FG.getChoices();
   if (DEBUG_PLUGIN)
     std::cerr << "parsed " << C1.size() << " choices\n";
-  mutator::mutate_choices(C1);
+  // the other test case came from this mutator too, so its choices
+  // should parse, but if they don't, just mutate without them
+  auto &C2 = SpliceFG.getChoices();
+  C2.clear();
+  if (Splice && add_buf &&
+      SpliceFG.parseChoices((const char *)add_buf, add_buf_size, Prefix))
+    mutator::mutate_choices(C1, C2);
+  else
+    mutator::mutate_choices(C1);
   if (DEBUG_PLUGIN)
     std::cerr << "mutated\n";
-  FG.replaceChoices(C1);
+
+  if (Persistent || Plugin) {
+    const char *Out;
+    size_t amount;
+    if (Plugin) {
+      Plugin->run(FG, PluginOutput);
+      Out = PluginOutput.data();
+      amount = std::min(PluginOutput.size(), (size_t)MAX_FILE);
+    } else if (!Persistent->run(C1, Out, amount)) {
+      std::cerr << "ERROR: persistent generator died\n";
+      exit(-1);
+    }
+    if (!ExtraCommand.empty()) {
+      std::string OutFn(std::tmpnam(nullptr));
+      {
+        std::ofstream Outf(OutFn, std::ios::binary);
+        Outf.write(Out, amount);
+      }
+      runExtraCommand(OutFn);
+      std::remove(OutFn.c_str());
+    }
+    // AFL++ only reads the output, so hand it the generator's buffer
+    *out_buf = (u8 *)Out;
+    return amount;
+  }
 
   tree_guide::SaverGuide SG(&FG, Prefix);
   auto Ch = SG.makeChooser();
@@ -132,25 +230,31 @@ extern "C" size_t afl_custom_fuzz(my_mutator *data, uint8_t *buf,
           << "ERROR: mutator plugin could not save a file for the generator\n";
       exit(-1);
     }
-    Outf << Prefix + tree_guide::StartMarker + "\n";
-    Outf << Prefix;
-    for (auto c : C1) {
-      switch (c.k) {
-      case tree_guide::RecKind::START:
-        Outf << "{";
-        break;
-      case tree_guide::RecKind::END:
-        Outf << "}";
-        break;
-      case tree_guide::RecKind::NUM:
-        Outf << c.v;
-        break;
-      default:
-        assert(false);
+    if (BinaryChoices) {
+      std::string Bin;
+      tree_guide::encodeChoices(C1, Bin);
+      Outf << Bin;
+    } else {
+      Outf << Prefix + tree_guide::StartMarker + "\n";
+      Outf << Prefix;
+      for (auto c : C1) {
+        switch (c.k) {
+        case tree_guide::RecKind::START:
+          Outf << "{";
+          break;
+        case tree_guide::RecKind::END:
+          Outf << "}";
+          break;
+        case tree_guide::RecKind::NUM:
+          Outf << c.v;
+          break;
+        default:
+          assert(false);
+        }
+        Outf << ",";
       }
-      Outf << ",";
+      Outf << "\n" << Prefix + tree_guide::EndMarker + "\n";
     }
-    Outf << "\n" << Prefix + tree_guide::EndMarker + "\n";
     Outf.close();
   }
 
@@ -188,39 +292,7 @@ extern "C" size_t afl_custom_fuzz(my_mutator *data, uint8_t *buf,
     exit(-1);
   }
 
-  if (!ExtraCommand.empty()) {
-    auto pid2 = fork();
-    if (pid2 == -1) {
-      std::cerr << "ERROR: fork failed\n";
-      exit(-1);
-    }
-    if (pid2 == 0) {
-      // child
-
-      // it seems like it would be a nice thing to do to shut down the
-      // shared memory window before we exec the outside code, but
-      // this function invocation crashes, for whatever reason
-      // afl_shm_deinit(&data->afl->shm);
-
-      auto res = execl(ExtraCommand.c_str(), ExtraCommand.c_str(), OutFn.c_str(), (char *)nullptr);
-      // of course this line normally does not execute
-      exit(res);
-    }
-    // wait for the child process -- this keeps total machine load to
-    // a predictable factor and also prevents the plugin from removing
-    // the temp file while the second child is still looking at it
-    int wstatus;
-    waitpid(pid2, &wstatus, 0);
-    if (!WIFEXITED(wstatus)) {
-      std::cerr << "ERROR: child2 exited abnormally\n";
-      exit(-1);
-    }
-    auto ret = WEXITSTATUS(wstatus);
-    if (ret != 0) {
-      std::cerr << "ERROR: child2 did not return 0\n";
-      exit(-1);
-    }
-  }
+  runExtraCommand(OutFn);
 
   std::streamsize amount;
   {
@@ -275,6 +347,8 @@ extern "C" uint8_t afl_custom_havoc_mutation_probability(my_mutator *data) {
 }
 
 extern "C" void afl_custom_deinit(my_mutator *data) {
+  Persistent.reset();
+  Plugin.reset();
   free(data->post_process_buf);
   free(data->mutated_out);
   free(data->trim_buf);
@@ -1,15 +1,36 @@
 #ifndef TREE_GUIDE_H_
 #define TREE_GUIDE_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <fstream>
-#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <optional>
 #include <queue>
 #include <random>
-#include <unordered_map>
+#include <shared_mutex>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
 namespace tree_guide {
@@ -45,6 +66,42 @@ public:
   virtual uint64_t chooseUnimportant() = 0;
   virtual void beginScope() = 0;
   virtual void endScope() = 0;
+  /*
+   * optional support for traversals that are made somewhere else, for
+   * example by a remote client that makes its choices locally. plan()
+   * fills in the choices that this chooser wants to make at the start
+   * of its traversal, where it already knows the tree; beyond those,
+   * it is content with choices made at random. replay() then tells it
+   * about every choice that was actually made, in order, starting with
+   * the planned ones; scopes are passed on as usual. choosers that
+   * can't be driven like this return false from plan()
+   */
+  virtual bool plan(std::vector<uint64_t> &) { return false; }
+  virtual void replay(uint64_t, const std::vector<double> &, uint64_t) {
+    // a chooser that can't plan is never asked to replay, so getting
+    // here means the choice would silently go missing
+    std::cerr << "FATAL ERROR: This chooser doesn't support replay\n\n";
+    exit(-1);
+  }
+  /*
+   * say that this traversal will never be finished, for example because
+   * the client making it went away, so that the chooser's destructor
+   * discards it instead of learning from it. choosers that learn
+   * nothing from a traversal can ignore this
+   */
+  virtual void abandon() {}
+  /*
+   * say whether the next choice can be among Choices options, or, if
+   * Choices is 0, whether the traversal can end here. the answer is no
+   * when the guide has already seen this point in the tree offer a
+   * different number, which choose() and replay() treat as a fatal
+   * error; a server asks first, so that one misbehaving client can't
+   * take it down. Weights are those of a weighted choice, or empty.
+   * choosers that don't keep a tree can always say yes
+   */
+  virtual bool canChoose(uint64_t, const std::vector<double> &) {
+    return true;
+  }
 };
 
 class Guide {
@@ -127,13 +184,388 @@ uint64_t DefaultChooser::chooseUnimportant() {
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
- * BFSGuide: exhaustive breadth-first exploration of the decision
- * tree, reverting to random choices once beyond the BFS frontier
+ * Arena: bump allocator that hands out 32-bit indices instead of
+ * pointers. storage is a list of segments whose sizes double, so
+ * growing the arena never moves existing elements, and the elements
+ * returned by a single alloc() call have contiguous indices. nothing
+ * is ever freed until the arena itself goes away. alloc() and at()
+ * may be called from several threads at once
+ */
+
+template <typename T> class Arena {
+  static const unsigned FirstSegmentBits = 10;
+  static const unsigned MaxSegments = 33 - FirstSegmentBits;
+  std::atomic<T *> Segments[MaxSegments] = {};
+  std::atomic<uint64_t> Size{0};
+
+  static unsigned log2Floor(uint64_t X) { return 63 - __builtin_clzll(X); }
+
+  static uint64_t segmentSize(unsigned Seg) {
+    return (uint64_t)1 << (FirstSegmentBits + Seg);
+  }
+
+public:
+  /*
+   * largest number of elements an arena can hold; the top two
+   * indices are left unused so that callers can use them as sentinels
+   */
+  static const uint64_t Capacity = (uint64_t)UINT32_MAX - 1;
+
+  Arena() {}
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() {
+    for (auto &S : Segments)
+      delete[] S.load();
+  }
+
+  /*
+   * allocate N contiguous value-initialized elements, returning the
+   * index of the first one
+   */
+  uint32_t alloc(uint64_t N) {
+    uint64_t First = Size.fetch_add(N);
+    if (First + N > Capacity) {
+      std::cerr << "FATAL ERROR: Arena exhausted\n\n";
+      exit(-1);
+    }
+    if (N > 0) {
+      unsigned Last =
+          log2Floor(First + N - 1 + segmentSize(0)) - FirstSegmentBits;
+      for (unsigned Seg = 0; Seg <= Last; ++Seg) {
+        if (Segments[Seg].load())
+          continue;
+        // if another thread installs this segment first, ours is
+        // simply thrown away
+        T *New = new T[segmentSize(Seg)]();
+        T *Expected = nullptr;
+        if (!Segments[Seg].compare_exchange_strong(Expected, New))
+          delete[] New;
+      }
+    }
+    return First;
+  }
+
+  T &at(uint32_t I) {
+    assert(I < Size);
+    uint64_t J = (uint64_t)I + segmentSize(0);
+    unsigned Top = log2Floor(J);
+    return Segments[Top - FirstSegmentBits].load()[J - ((uint64_t)1 << Top)];
+  }
+
+  uint64_t size() const { return Size; }
+
+  /*
+   * call Fn(Ptr, N) for each run of N elements that are contiguous in
+   * memory, in index order
+   */
+  template <typename F> void forEachRun(F Fn) {
+    uint64_t Left = Size;
+    for (unsigned Seg = 0; Left > 0; ++Seg) {
+      uint64_t N = std::min(Left, segmentSize(Seg));
+      Fn(Segments[Seg].load(), N);
+      Left -= N;
+    }
+  }
+
+  /*
+   * make the arena hold exactly the N elements at Src, which must be
+   * laid out just as the arena lays them out; the arena can't already
+   * hold more than N
+   */
+  void assign(const void *Src, uint64_t N) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "only plain data can be copied in as bytes");
+    assert(Size <= N);
+    alloc(N - Size);
+    auto *Bytes = (const char *)Src;
+    uint64_t First = 0;
+    while (N > 0) {
+      uint64_t J = First + segmentSize(0);
+      unsigned Top = log2Floor(J);
+      uint64_t Offset = J - ((uint64_t)1 << Top);
+      uint64_t Run =
+          std::min(N, segmentSize(Top - FirstSegmentBits) - Offset);
+      std::memcpy((void *)&Segments[Top - FirstSegmentBits].load()[Offset],
+                  Bytes, Run * sizeof(T));
+      Bytes += Run * sizeof(T);
+      First += Run;
+      N -= Run;
+    }
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * snapshots: a guide's learned tree, saved to a file so that a
+ * restarted generator can pick up where it left off. a snapshot is a
+ * header followed by a fixed sequence of sections, each of which is a
+ * flat array:
+ *
+ * - header: the magic string "TGSNAP", a 32-bit version, a 32-bit
+ *   kind saying which guide wrote it, a 64-bit count of scalars, and
+ *   then the scalars, all 64 bits wide
+ *
+ * - section: a 64-bit element count, the 64-bit size of an element,
+ *   then the elements, padded out to a multiple of 8 bytes
+ *
+ * nodes refer to each other by arena index, so the arrays contain no
+ * pointers. loading maps the file and rebuilds the arenas from it,
+ * rather than using it in place: arrays of plain data are laid out
+ * exactly as in memory and copied over with memcpy, while anything
+ * holding atomics is saved as plain records and rebuilt element by
+ * element. every index is checked before it is used, so a corrupt
+ * file is rejected instead of being followed off the end of an arena.
+ * numbers are in the native byte order, and element sizes are
+ * checked, so a snapshot is only meant to be read back by the same
+ * build of the same guide
  */
 
-// TODO this guide uses way too much memory -- since it never frees,
-// it shouldn't be too difficult to replace its allocated cells with a
-// large flat allocation
+enum class SnapshotKind : uint32_t { BFS = 1, WEIGHTED_SAMPLER };
+
+static const char SnapshotMagic[8] = {'T', 'G', 'S', 'N', 'A', 'P', 0, 0};
+static const uint32_t SnapshotVersion = 2;
+
+class SnapshotWriter {
+  std::ofstream Out;
+  const std::string FileName;
+
+  inline void put(uint64_t X) { Out.write((const char *)&X, sizeof(X)); }
+
+public:
+  inline SnapshotWriter(const std::string &_FileName, SnapshotKind Kind,
+                        const std::vector<uint64_t> &Scalars)
+      : Out(_FileName, std::ios::binary | std::ios::trunc),
+        FileName(_FileName) {
+    uint32_t Version = SnapshotVersion;
+    Out.write(SnapshotMagic, sizeof(SnapshotMagic));
+    Out.write((const char *)&Version, sizeof(Version));
+    Out.write((const char *)&Kind, sizeof(Kind));
+    put(Scalars.size());
+    for (auto X : Scalars)
+      put(X);
+  }
+
+  // start a section; the caller then writes exactly N * EltSize bytes
+  inline void begin(uint64_t N, uint64_t EltSize) {
+    put(N);
+    put(EltSize);
+  }
+
+  inline void bytes(const void *Data, uint64_t Len) {
+    Out.write((const char *)Data, Len);
+  }
+
+  inline void end() {
+    static const char Zeros[8] = {};
+    Out.write(Zeros, (8 - Out.tellp() % 8) % 8);
+  }
+
+  template <typename T> inline void section(const T *Data, uint64_t N) {
+    begin(N, sizeof(T));
+    bytes(Data, N * sizeof(T));
+    end();
+  }
+
+  template <typename T> inline void section(const std::vector<T> &V) {
+    section(V.data(), V.size());
+  }
+
+  template <typename T> inline void section(Arena<T> &A) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "only plain data can be written out as bytes");
+    begin(A.size(), sizeof(T));
+    A.forEachRun([&](T *Run, uint64_t Len) { bytes(Run, Len * sizeof(T)); });
+    end();
+  }
+
+  /*
+   * write an arena of elements that aren't plain data, such as
+   * atomics, as records of type R; Fn(Elt, Rec) fills in a record
+   */
+  template <typename R, typename T, typename F>
+  inline void section(Arena<T> &A, F Fn) {
+    static_assert(std::is_trivially_copyable<R>::value,
+                  "records must be plain data");
+    const uint64_t BufSize = 4096;
+    std::vector<R> Buf;
+    begin(A.size(), sizeof(R));
+    A.forEachRun([&](T *Run, uint64_t Len) {
+      for (uint64_t I = 0; I < Len; I += BufSize) {
+        Buf.assign(std::min(BufSize, Len - I), R{});
+        for (uint64_t J = 0; J < Buf.size(); ++J)
+          Fn(Run[I + J], Buf[J]);
+        bytes(Buf.data(), Buf.size() * sizeof(R));
+      }
+    });
+    end();
+  }
+
+  inline bool finish() {
+    Out.close();
+    if (!Out) {
+      std::cerr << "FATAL ERROR: Cannot write snapshot '" << FileName
+                << "'\n\n";
+      return false;
+    }
+    return true;
+  }
+};
+
+class SnapshotReader {
+  const std::string FileName;
+  const char *Map = nullptr;
+  uint64_t Length = 0, Pos = 0;
+  bool Ok = false;
+
+  inline bool get(uint64_t &X) {
+    if (Length - Pos < sizeof(X))
+      return false;
+    std::memcpy(&X, Map + Pos, sizeof(X));
+    Pos += sizeof(X);
+    return true;
+  }
+
+  inline bool fail(const std::string &Why) {
+    std::cerr << "FATAL ERROR: Snapshot '" << FileName << "' " << Why
+              << "\n\n";
+    Ok = false;
+    return false;
+  }
+
+public:
+  std::vector<uint64_t> Scalars;
+
+  inline SnapshotReader(const std::string &_FileName, SnapshotKind Kind,
+                        uint64_t NumScalars)
+      : FileName(_FileName) {
+    int FD = open(FileName.c_str(), O_RDONLY);
+    struct stat Stat;
+    if (FD < 0 || fstat(FD, &Stat) != 0) {
+      std::cerr << "FATAL ERROR: Cannot open snapshot '" << FileName
+                << "'\n\n";
+      if (FD >= 0)
+        close(FD);
+      return;
+    }
+    Length = Stat.st_size;
+    if (Length > 0) {
+      void *P = mmap(nullptr, Length, PROT_READ, MAP_PRIVATE, FD, 0);
+      if (P != MAP_FAILED)
+        Map = (const char *)P;
+    }
+    close(FD);
+    Ok = true;
+    if (!Map) {
+      fail(Length == 0 ? "is empty" : "cannot be mapped");
+      return;
+    }
+    uint32_t Version, FileKind;
+    if (Length < sizeof(SnapshotMagic) + 8 ||
+        std::memcmp(Map, SnapshotMagic, sizeof(SnapshotMagic)) != 0) {
+      fail("is not a snapshot");
+      return;
+    }
+    std::memcpy(&Version, Map + 8, sizeof(Version));
+    std::memcpy(&FileKind, Map + 12, sizeof(FileKind));
+    Pos = 16;
+    if (Version != SnapshotVersion) {
+      fail("has an unsupported version");
+      return;
+    }
+    if (FileKind != (uint32_t)Kind) {
+      fail("was written by a different kind of guide");
+      return;
+    }
+    uint64_t N;
+    if (!get(N) || N != NumScalars) {
+      fail("has a malformed header");
+      return;
+    }
+    Scalars.resize(N);
+    for (auto &X : Scalars)
+      if (!get(X)) {
+        fail("is truncated");
+        return;
+      }
+  }
+
+  inline ~SnapshotReader() {
+    if (Map)
+      munmap((void *)Map, Length);
+  }
+
+  inline bool ok() { return Ok; }
+
+  /*
+   * return the next section's elements, which must be EltSize bytes
+   * each, storing their number in N; returns nullptr if the file is
+   * malformed
+   */
+  inline const void *section(uint64_t EltSize, uint64_t &N) {
+    uint64_t Size;
+    if (!Ok)
+      return nullptr;
+    if (!get(N) || !get(Size)) {
+      fail("is truncated");
+      return nullptr;
+    }
+    if (Size != EltSize) {
+      fail("does not match this build of the guide");
+      return nullptr;
+    }
+    if (N > (Length - Pos) / EltSize) {
+      fail("is truncated");
+      return nullptr;
+    }
+    auto *Data = Map + Pos;
+    Pos += N * EltSize;
+    Pos += (8 - Pos % 8) % 8;
+    if (Pos > Length)
+      Pos = Length;
+    return Data;
+  }
+
+  template <typename T> inline bool section(std::vector<T> &V) {
+    uint64_t N;
+    auto *Data = (const T *)section(sizeof(T), N);
+    if (!Data)
+      return false;
+    V.assign(Data, Data + N);
+    return true;
+  }
+
+  // the I'th record of a section returned by section()
+  template <typename R> static inline R record(const void *Data, uint64_t I) {
+    R Rec;
+    std::memcpy(&Rec, (const char *)Data + I * sizeof(R), sizeof(R));
+    return Rec;
+  }
+
+  // report a section whose contents don't make sense; returns false
+  inline bool corrupt(const std::string &What) {
+    return fail("has a corrupt " + What);
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * BFSGuide: exhaustive breadth-first exploration of the decision
+ * tree, reverting to random choices once beyond the BFS frontier.
+ *
+ * several choosers from the same guide may be live at once, in
+ * different threads. each of them is sent down a path to a different
+ * untaken edge, and below that edge it only ever touches nodes that
+ * it created itself, so choosers never race to fill in the same slot
+ * and choose() takes no locks. the queue of pending paths is sharded
+ * per thread, and is touched once when a chooser is made and once
+ * when it is destroyed. a thread must not ask for a new chooser while
+ * it still holds one: if there is nothing left to hand out,
+ * makeChooser() waits for the live choosers to finish, since they may
+ * yet add pending paths. debug builds catch this with a ThreadClaim
+ */
 
 template <typename T> class PriQ {
   struct Elt {
@@ -208,44 +640,222 @@ public:
    * levels are empty
    */
   uint64_t firstNonemptyLevel() { return Highest; }
+
+  /*
+   * call Fn(t, Level) for every item, in priority order
+   */
+  template <typename F> void forEach(F Fn) {
+    for (uint64_t L = 0; L < Data.size(); ++L) {
+      auto &Q = Data.at(L);
+      for (uint64_t i = Q.StartPos; i < Q.Vec.size(); ++i)
+        Fn(Q.Vec.at(i), L);
+    }
+  }
+};
+
+/*
+ * a small dense number for the calling thread, handed out the first
+ * time each thread asks
+ */
+inline unsigned workerIndex() {
+  static std::atomic<unsigned> NextWorker{0};
+  thread_local unsigned Index = NextWorker++;
+  return Index;
+}
+
+/*
+ * a chooser's claim on its guide, on behalf of the thread that made
+ * it. guides that can be shared between threads sometimes wait for
+ * live choosers to finish, so a thread that asks for a chooser while
+ * it still holds one from the same guide could wait for itself
+ * forever; in debug builds their makeChooser() asserts that it
+ * doesn't. a chooser must be destroyed by the thread that made it
+ */
+class ThreadClaim {
+#ifndef NDEBUG
+  const void *Owner;
+
+  static std::vector<const void *> &claims() {
+    thread_local std::vector<const void *> Claims;
+    return Claims;
+  }
+#endif
+
+public:
+  inline ThreadClaim(const void *_Owner) {
+#ifndef NDEBUG
+    Owner = _Owner;
+    assert(!held(Owner));
+    claims().push_back(Owner);
+#else
+    (void)_Owner;
+#endif
+  }
+  ThreadClaim(const ThreadClaim &) = delete;
+  ThreadClaim &operator=(const ThreadClaim &) = delete;
+  inline ~ThreadClaim() {
+#ifndef NDEBUG
+    auto &C = claims();
+    auto It = std::find(C.begin(), C.end(), Owner);
+    assert(It != C.end());
+    if (It != C.end())
+      C.erase(It);
+#endif
+  }
+
+  // whether the calling thread holds a chooser from Owner
+  static inline bool held(const void *Owner) {
+#ifndef NDEBUG
+    auto &C = claims();
+    return std::find(C.begin(), C.end(), Owner) != C.end();
+#else
+    (void)Owner;
+    return false;
+#endif
+  }
+};
+
+/*
+ * StealingPriQ: a PriQ split into one shard per worker. a worker
+ * inserts into and removes from its own shard, and only steals the
+ * head of some other shard when its own is empty, so the shard locks
+ * are almost never contended. ordering by level is only approximate:
+ * a worker drains its own shard shallowest-first even if some other
+ * shard holds something shallower. a single worker sees exactly the
+ * ordering of a plain PriQ
+ */
+
+template <typename T> class StealingPriQ {
+  struct Shard {
+    std::mutex Lock;
+    PriQ<T> Q;
+  };
+  std::vector<Shard> Shards;
+
+public:
+  StealingPriQ(unsigned NumShards) : Shards(NumShards > 0 ? NumShards : 1) {}
+
+  void insert(T t, uint64_t Level, unsigned Worker) {
+    auto &S = Shards.at(Worker % Shards.size());
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    S.Q.insert(t, Level);
+  }
+
+  /*
+   * remove the head of the worker's own shard, or failing that, the
+   * head of the next nonempty shard after it
+   */
+  std::pair<std::optional<T>, uint64_t> removeHead(unsigned Worker) {
+    for (size_t i = 0; i < Shards.size(); ++i) {
+      auto &S = Shards.at((Worker + i) % Shards.size());
+      std::lock_guard<std::mutex> Guard(S.Lock);
+      auto Head = S.Q.removeHead();
+      if (Head.first.has_value())
+        return Head;
+    }
+    return {{}, (uint64_t)-1};
+  }
+
+  template <typename F> void forEach(F Fn) {
+    for (auto &S : Shards) {
+      std::lock_guard<std::mutex> Guard(S.Lock);
+      S.Q.forEach(Fn);
+    }
+  }
 };
 
 class BFSChooser;
 
 class BFSGuide : public Guide {
   friend BFSChooser;
+  /*
+   * nodes and their child slots live in two flat arenas and refer to
+   * each other by index. a node's children occupy Degree consecutive
+   * slots starting at FirstChild; a slot holds the index of the child
+   * node, or Untaken if that edge has not been explored yet. since
+   * the root is node 0 and is nobody's child, 0 is free to serve as
+   * the untaken marker. most of the tree is leaves, which never need
+   * a node of their own: a slot leading to a leaf just holds Leaf,
+   * an index the arena never hands out. Reserved, the other index
+   * the arena never hands out, marks an untaken edge that a live
+   * chooser has been sent to explore
+   */
   struct Node {
-    Node *Parent;
-    std::vector<std::unique_ptr<BFSGuide::Node>> Children;
+    uint32_t Parent;
+    // the slot, in our parent's range, that points to us
+    uint32_t Slot;
+    uint32_t FirstChild;
+    uint32_t Degree;
   };
-
-  uint64_t TotalNodes = 0;
-  std::unique_ptr<BFSGuide::Node> Root;
-  PriQ<Node *> PendingPaths;
-  uint64_t MaxSavedLevel = (uint64_t)-1;
-  bool Choosing = false, Started = false;
-  // TODO move this into the chooser?
-  std::unique_ptr<std::mt19937_64> Rand;
+  static const uint32_t Root = 0, Untaken = 0;
+  static const uint32_t Reserved = (uint32_t)Arena<Node>::Capacity;
+  static const uint32_t Leaf = Reserved + 1;
+
+  std::atomic<uint64_t> TotalNodes{0};
+  Arena<Node> Nodes;
+  Arena<std::atomic<uint32_t>> Slots;
+  StealingPriQ<uint32_t> PendingPaths{std::thread::hardware_concurrency()};
+  std::atomic<uint64_t> MaxSavedLevel{(uint64_t)-1};
+  // live choosers, plus threads inside makeChooser() that may be about
+  // to create one
+  std::atomic<uint64_t> LiveChoosers{0};
+  std::atomic<bool> Started{false}, Overlapped{false};
+  // each chooser's PRNG is seeded with Seed plus the number of
+  // choosers made before it
+  const uint64_t Seed;
+  std::atomic<uint64_t> NumChoosers{0};
+
+  // only used by threads that have to wait for something to do
+  std::mutex Lock;
+  std::condition_variable Finished;
+  std::atomic<uint64_t> Waiters{0};
+
+  inline uint32_t newNode(uint32_t Parent, uint32_t Slot, uint64_t Degree);
+  inline void wakeWaiters();
+  inline bool waitForPaths(std::pair<std::optional<uint32_t>, uint64_t> &Head,
+                           unsigned Worker);
 
 public:
   inline BFSGuide(uint64_t Seed);
   inline BFSGuide() : BFSGuide(std::random_device{}()) {}
   inline ~BFSGuide() {}
   inline std::unique_ptr<Chooser> makeChooser() override;
+  /*
+   * save the explored tree to a snapshot file, or restore it into a
+   * guide that has not made any choosers yet; there must be no live
+   * choosers. these return false, after printing a message, on error
+   */
+  inline bool saveSnapshot(const std::string &FileName);
+  inline bool loadSnapshot(const std::string &FileName);
   inline const std::string name() override { return "BFS"; }
 };
 
 class BFSChooser : public Chooser {
   friend BFSGuide;
   BFSGuide &G;
-  BFSGuide::Node *Current;
+  ThreadClaim Claim;
+  const unsigned Worker;
+  std::mt19937_64 Rand;
+  uint32_t Current = BFSGuide::Root;
   uint64_t LastChoice = 0, Level = 0;
   // this vector is in reverse order so we can pop stuff efficiently
   std::vector<uint64_t> SavedChoices;
-  inline uint64_t chooseInternal(uint64_t, std::function<uint64_t()>);
+  // nodes we created that still have unexplored branches, with their
+  // levels; these go into the guide's queue when we're done
+  std::vector<std::pair<uint32_t, uint64_t>> NewPaths;
+  // the node we were sent to, its level, and the slot in it that we
+  // reserved, so that an abandoned traversal can give them back
+  uint32_t Target = BFSGuide::Root, ReservedSlot = BFSGuide::Reserved;
+  uint64_t TargetLevel = 0;
+  bool Abandoned = false;
+  // templated on the random choice so that it inlines into the hot
+  // path, instead of going through a std::function
+  template <typename RandomChoice>
+  inline uint64_t chooseInternal(uint64_t, RandomChoice &&);
 
 public:
-  inline BFSChooser(BFSGuide &_G) : G(_G) { Current = &*G.Root; }
+  inline BFSChooser(BFSGuide &_G, unsigned _Worker, uint64_t Seed)
+      : G(_G), Claim(&_G), Worker(_Worker), Rand(Seed) {}
   inline ~BFSChooser();
   inline uint64_t choose(uint64_t Choices) override;
   inline bool flip() override;
@@ -254,93 +864,222 @@ public:
   inline uint64_t chooseUnimportant() override;
   inline void beginScope() override {}
   inline void endScope() override {}
+  inline bool plan(std::vector<uint64_t> &Prefix) override;
+  inline void replay(uint64_t Choices, const std::vector<double> &,
+                     uint64_t Choice) override;
+  inline void abandon() override { Abandoned = true; }
+  inline bool canChoose(uint64_t Choices,
+                        const std::vector<double> &) override;
 };
 
-BFSGuide::BFSGuide(uint64_t Seed) {
-  Root = std::make_unique<BFSGuide::Node>();
-  Root->Children.resize(1);
-  Rand = std::make_unique<std::mt19937_64>(Seed);
+BFSGuide::BFSGuide(uint64_t _Seed) : Seed(_Seed) {
+  // the root is a placeholder whose single child is the first real
+  // decision made by the generator
+  newNode(Root, 0, 1);
+}
+
+void BFSGuide::wakeWaiters() {
+  // a waiter checks its predicate while holding Lock, so passing
+  // through Lock here ensures that it either sees our update or is
+  // already asleep and gets the notification
+  if (Waiters > 0) {
+    std::lock_guard<std::mutex> Guard(Lock);
+  }
+  Finished.notify_all();
+}
+
+/*
+ * nothing to hand out yet, but the live choosers may find more; once
+ * every live thread in here is waiting, nobody can. returns whether
+ * a path turned up
+ */
+bool BFSGuide::waitForPaths(
+    std::pair<std::optional<uint32_t>, uint64_t> &Head, unsigned Worker) {
+  ++Waiters;
+  std::unique_lock<std::mutex> Guard(Lock);
+  Finished.wait(Guard, [&] {
+    Head = PendingPaths.removeHead(Worker);
+    return Head.first.has_value() || LiveChoosers == Waiters;
+  });
+  --Waiters;
+  return Head.first.has_value();
+}
+
+bool BFSGuide::saveSnapshot(const std::string &FileName) {
+  assert(LiveChoosers == 0);
+  SnapshotWriter W(FileName, SnapshotKind::BFS,
+                   {TotalNodes, MaxSavedLevel, Started, Overlapped,
+                    NumChoosers});
+  W.section(Nodes);
+  W.section<uint32_t>(Slots, [](std::atomic<uint32_t> &S, uint32_t &Rec) {
+    Rec = S.load();
+  });
+  std::vector<std::pair<uint64_t, uint64_t>> Pending;
+  PendingPaths.forEach(
+      [&](uint32_t N, uint64_t Level) { Pending.push_back({N, Level}); });
+  W.section(Pending);
+  return W.finish();
+}
+
+bool BFSGuide::loadSnapshot(const std::string &FileName) {
+  assert(LiveChoosers == 0 && !Started && Nodes.size() == 1);
+  SnapshotReader R(FileName, SnapshotKind::BFS, 5);
+  uint64_t NumNodes, NumSlots;
+  auto *NodeData = R.section(sizeof(Node), NumNodes);
+  auto *SlotData = R.section(sizeof(uint32_t), NumSlots);
+  std::vector<std::pair<uint64_t, uint64_t>> Pending;
+  if (!NodeData || !SlotData || !R.section(Pending))
+    return false;
+  if (NumNodes < Nodes.size() || NumSlots < Slots.size())
+    return R.corrupt("root");
+
+  /*
+   * every node but the root must be pointed to by a slot in its
+   * parent's range, and come after its parent, so the nodes form a
+   * tree; every slot is untaken, a leaf, or points to such a node
+   */
+  auto RootNode = SnapshotReader::record<Node>(NodeData, Root);
+  if ((uint64_t)RootNode.FirstChild + RootNode.Degree > NumSlots)
+    return R.corrupt("root");
+  for (uint64_t I = 1; I < NumNodes; ++I) {
+    auto N = SnapshotReader::record<Node>(NodeData, I);
+    if (N.Parent >= I || (uint64_t)N.FirstChild + N.Degree > NumSlots)
+      return R.corrupt("node");
+    auto P = SnapshotReader::record<Node>(NodeData, N.Parent);
+    if (N.Slot < P.FirstChild || N.Slot - P.FirstChild >= P.Degree ||
+        SnapshotReader::record<uint32_t>(SlotData, N.Slot) != I)
+      return R.corrupt("node");
+  }
+  for (uint64_t I = 0; I < NumSlots; ++I) {
+    auto S = SnapshotReader::record<uint32_t>(SlotData, I);
+    if (S != Untaken && S != Leaf &&
+        (S >= NumNodes || SnapshotReader::record<Node>(NodeData, S).Slot != I))
+      return R.corrupt("slot");
+  }
+  for (auto [N, Level] : Pending)
+    if (N >= NumNodes)
+      return R.corrupt("pending path");
+
+  Nodes.assign(NodeData, NumNodes);
+  Slots.alloc(NumSlots - Slots.size());
+  for (uint64_t I = 0; I < NumSlots; ++I)
+    Slots.at(I) = SnapshotReader::record<uint32_t>(SlotData, I);
+  TotalNodes = R.Scalars[0];
+  MaxSavedLevel = R.Scalars[1];
+  Started = R.Scalars[2];
+  Overlapped = R.Scalars[3];
+  NumChoosers = R.Scalars[4];
+  auto Worker = workerIndex();
+  for (auto [N, Level] : Pending)
+    PendingPaths.insert(N, Level, Worker);
+  return true;
+}
+
+uint32_t BFSGuide::newNode(uint32_t Parent, uint32_t Slot, uint64_t Degree) {
+  if (Degree > UINT32_MAX) {
+    std::cout << "FATAL ERROR: BFS guide cannot handle a choice with "
+              << Degree << " options\n\n";
+    exit(-1);
+  }
+  auto Index = Nodes.alloc(1);
+  auto &N = Nodes.at(Index);
+  N.Parent = Parent;
+  N.Slot = Slot;
+  N.FirstChild = Slots.alloc(Degree);
+  N.Degree = Degree;
+  return Index;
 }
 
 std::unique_ptr<Chooser> BFSGuide::makeChooser() {
   if (Verbose)
     std::cout << "*** START *** (total nodes = " << TotalNodes << ")\n";
-  assert(!Choosing);
+  // waiting below for our own chooser to finish would hang
+  assert(!ThreadClaim::held(this));
+  if (LiveChoosers++ > 0)
+    Overlapped = true;
+  auto Worker = workerIndex();
   /*
    * case 1: this is the first traversal; we've not yet seen any of
    * the decision tree, so do a purely random traversal to bootstrap
    * things
    */
-  if (!Started) {
+  if (!Started.exchange(true)) {
     if (Verbose)
       std::cout << "  First traversal\n";
-    Started = true;
-    Choosing = true;
-    return std::make_unique<BFSChooser>(*this);
+    return std::make_unique<BFSChooser>(*this, Worker, Seed + NumChoosers++);
   }
   /*
    * case 2: the priority queue has unexplored decisions for us to
    * traverse, this is where we spent most of our time of course
    */
-  auto [OptionalNode, SavedLevel] = PendingPaths.removeHead();
-  if (OptionalNode.has_value()) {
-    assert((MaxSavedLevel == (uint64_t)-1) || (SavedLevel >= MaxSavedLevel));
+  std::pair<std::optional<uint32_t>, uint64_t> Head;
+  while ((Head = PendingPaths.removeHead(Worker)).first.has_value() ||
+         waitForPaths(Head, Worker)) {
+    auto N = Head.first.value();
+    auto SavedLevel = Head.second;
+    auto &Target = Nodes.at(N);
+    // we're at the target node, so find an untaken branch and reserve
+    // it so no other chooser is sent there. an abandoned traversal can
+    // leave a second copy of a node in the queue, so a node may have
+    // been used up since it was queued, or be in use by another
+    // chooser right now
+    // TODO: this is deterministic, it would be better to pick a random one
+    uint64_t Next = Target.Degree;
+    while (Next-- > 0) {
+      auto Child = Untaken;
+      if (Slots.at(Target.FirstChild + Next)
+              .compare_exchange_strong(Child, Reserved))
+        break;
+    }
+    if (Next == (uint64_t)-1)
+      continue;
+    uint64_t NumUntaken = 0;
+    for (uint64_t i = 0; i < Next; ++i) {
+      auto Child = Slots.at(Target.FirstChild + i).load();
+      if (Verbose)
+        std::cout << "    child " << i << " = " << Child << "\n";
+      if (Child == Untaken)
+        NumUntaken++;
+    }
+    // with overlapping or abandoned choosers, a chooser that started
+    // early can queue paths that are shallower than ones we've already
+    // handed out, so the queue's levels only increase monotonically
+    // when choosers are used one at a time
+    assert(Overlapped || (MaxSavedLevel == (uint64_t)-1) ||
+           (SavedLevel >= MaxSavedLevel));
     if (Verbose && SavedLevel > MaxSavedLevel)
       std::cout << "fully explored up to " << SavedLevel << "\n";
     MaxSavedLevel = SavedLevel;
-    auto C = std::make_unique<BFSChooser>(*this);
-
-    auto N = OptionalNode.value();
-    BFSGuide::Node *N2 = nullptr;
+    auto C = std::make_unique<BFSChooser>(*this, Worker, Seed + NumChoosers++);
+    C->Target = N;
+    C->TargetLevel = SavedLevel;
+    C->ReservedSlot = Target.FirstChild + Next;
+    // if there's at least one remaining unexplored branch, put
+    // this node back at the end of its priority queue
+    if (NumUntaken > 0) {
+      if (Verbose)
+        std::cout << "  Re-inserting node\n";
+      PendingPaths.insert(N, SavedLevel, Worker);
+      wakeWaiters();
+    }
+    // the root is a placeholder that makes no choice of its own
+    if (N != Root) {
+      if (Verbose)
+        std::cout << "  appending " << Next
+                  << " to saved choice at target node\n";
+      C->SavedChoices.push_back(Next);
+    }
     // this loop walks up to the root, saving the decisions that we
     // have to make to get back down here
-    do {
-      uint64_t Next = (uint64_t)-1;
-      uint64_t S = N->Children.size();
-      if (N2) {
-        // we're above the target node, so just get to the target
-        for (uint64_t i = 0; i < S; ++i) {
-          if (N->Children.at(i).get() == N2) {
-            Next = i;
-            break;
-          }
-        }
-        if (Verbose)
-          std::cout << "  appending " << Next
-                    << " to saved choice above target node\n";
-      } else {
-        // we're at the target node, so find an untaken branch
-        // TODO: this is deterministic, it would be better to pick a random one
-        uint64_t NumUntaken = 0;
-        for (uint64_t i = 0; i < S; ++i) {
-          if (Verbose)
-            std::cout << "    child " << i << " = " << N->Children.at(i).get()
-                      << "\n";
-          if (N->Children.at(i).get() == nullptr) {
-            NumUntaken++;
-            Next = i;
-          }
-        }
-        if (Verbose)
-          std::cout << "  appending " << Next
-                    << " to saved choice at target node\n";
-        // this node should not have been there if there wasn't a branch
-        // left to explore
-        assert(NumUntaken > 0);
-        // if there's at least one remaining unexplored branch, put
-        // this node back at the end of its priority queue
-        if (NumUntaken > 1) {
-          if (Verbose)
-            std::cout << "  Re-inserting node\n";
-          PendingPaths.insert(N, SavedLevel);
-        }
-      }
-      assert(Next != (uint64_t)-1);
+    while (N != Root && Nodes.at(N).Parent != Root) {
+      auto &Child = Nodes.at(N);
+      Next = Child.Slot - Nodes.at(Child.Parent).FirstChild;
+      if (Verbose)
+        std::cout << "  appending " << Next
+                  << " to saved choice above target node\n";
       C->SavedChoices.push_back(Next);
-      N2 = N;
-      N = N->Parent;
-    } while (N != Root.get());
-    Choosing = true;
+      N = Child.Parent;
+    }
     return C;
   }
   /*
@@ -355,23 +1094,46 @@ std::unique_ptr<Chooser> BFSGuide::makeChooser() {
    */
   if (Verbose)
     std::cout << "  Tree has been completely explored!\n";
+  --LiveChoosers;
+  wakeWaiters();
   return nullptr;
 }
 
 BFSChooser::~BFSChooser() {
-  assert(SavedChoices.empty());
-  // TODO -- at scale this allocation will double our RAM usage, so
-  // eventually do this a different way
-  if (!Current->Children.at(LastChoice).get()) {
-    Current->Children.at(LastChoice) = std::make_unique<BFSGuide::Node>();
-    G.TotalNodes++;
+  auto &Slot = G.Slots.at(G.Nodes.at(Current).FirstChild + LastChoice);
+  auto N = Slot.load();
+  if (Abandoned) {
+    /*
+     * we never got to the end, so nothing is known to be a leaf. if we
+     * didn't get past the slot we were sent to, give it back to be
+     * explored by someone else; otherwise our last choice led into
+     * the unknown, and its node has to be queued again to get there.
+     * the nodes we made on the way are real, and stay
+     */
+    G.Overlapped = true;
+    if (ReservedSlot != BFSGuide::Reserved &&
+        G.Slots.at(ReservedSlot) == BFSGuide::Reserved) {
+      G.Slots.at(ReservedSlot) = BFSGuide::Untaken;
+      G.PendingPaths.insert(Target, TargetLevel, Worker);
+    } else if (N == BFSGuide::Untaken) {
+      G.PendingPaths.insert(Current, Level > 0 ? Level - 1 : 0, Worker);
+    }
+  } else {
+    assert(SavedChoices.empty());
+    if (N == BFSGuide::Untaken || N == BFSGuide::Reserved) {
+      Slot = BFSGuide::Leaf;
+      G.TotalNodes++;
+    }
   }
-  G.Choosing = false;
+  for (auto [N2, L] : NewPaths)
+    G.PendingPaths.insert(N2, L, Worker);
+  --G.LiveChoosers;
+  G.wakeWaiters();
 }
 
+template <typename RandomChoice>
 uint64_t BFSChooser::chooseInternal(const uint64_t Choices,
-                                    std::function<uint64_t()> randomChoice) {
-  assert(G.Choosing);
+                                    RandomChoice &&randomChoice) {
   if (Verbose) {
     std::cout << "choose(" << Choices << ")\n";
     std::cout << "  Current = " << Current << ", LastChoice = " << LastChoice
@@ -379,17 +1141,19 @@ uint64_t BFSChooser::chooseInternal(const uint64_t Choices,
   }
 
   uint64_t Choice;
-  auto N = Current->Children.at(LastChoice).get();
+  auto Slot = G.Nodes.at(Current).FirstChild + LastChoice;
+  auto N = G.Slots.at(Slot).load();
   if (Verbose)
-    std::cout << "Node pointer = " << N << "\n";
-  if (N) {
+    std::cout << "Node index = " << N << "\n";
+  if (N != BFSGuide::Untaken && N != BFSGuide::Reserved) {
     /*
      * we've arrived at a tree node that has already been visited
      */
-    if (Choices != N->Children.size()) {
+    if (N == BFSGuide::Leaf || Choices != G.Nodes.at(N).Degree) {
       // TODO it's unfriendly to exit here, but this is a critical API
       // violation. alternatively, of course we could throw an
-      // exception
+      // exception; callers that can't afford to exit ask canChoose()
+      // first
       std::cout << "FATAL ERROR: Reached same node again, but different "
                    "number of choices this time\n\n";
       exit(-1);
@@ -408,12 +1172,9 @@ uint64_t BFSChooser::chooseInternal(const uint64_t Choices,
      * and make a random choice
      */
     assert(SavedChoices.size() == 0);
-    N = new BFSGuide::Node;
+    N = G.newNode(Current, Slot, Choices);
     G.TotalNodes++;
-    N->Parent = Current;
-    N->Children.resize(Choices);
-    auto UN = std::unique_ptr<BFSGuide::Node>(N);
-    Current->Children.at(LastChoice) = std::move(UN);
+    G.Slots.at(Slot) = N;
     Choice = randomChoice();
     /*
      * if there are other options we'll need to get back to them later
@@ -422,7 +1183,7 @@ uint64_t BFSChooser::chooseInternal(const uint64_t Choices,
       if (Verbose)
         std::cout << "  Inserting node " << N << " at level " << Level
                   << " with degree " << Choices << "\n";
-      G.PendingPaths.insert(N, Level);
+      NewPaths.push_back({N, Level});
     }
   }
   Current = N;
@@ -436,7 +1197,7 @@ uint64_t BFSChooser::chooseInternal(const uint64_t Choices,
 uint64_t BFSChooser::choose(uint64_t Choices) {
   return chooseInternal(Choices, [&]() -> uint64_t {
     std::uniform_int_distribution<int> Dist(0, Choices - 1);
-    return Dist(*G.Rand);
+    return Dist(Rand);
   });
 }
 
@@ -445,18 +1206,41 @@ bool BFSChooser::flip() { return choose(2); }
 uint64_t BFSChooser::chooseWeighted(const std::vector<double> &Probs) {
   return chooseInternal(Probs.size(), [&]() -> uint64_t {
     std::discrete_distribution<uint64_t> Discrete(Probs.begin(), Probs.end());
-    return Discrete(*G.Rand.get());
+    return Discrete(Rand);
   });
 }
 
 uint64_t BFSChooser::chooseWeighted(const std::vector<uint64_t> &Probs) {
   return chooseInternal(Probs.size(), [&]() -> uint64_t {
     std::discrete_distribution<uint64_t> Discrete(Probs.begin(), Probs.end());
-    return Discrete(*G.Rand.get());
+    return Discrete(Rand);
   });
 }
 
-uint64_t BFSChooser::chooseUnimportant() { return fullRange(*G.Rand.get()); }
+uint64_t BFSChooser::chooseUnimportant() { return fullRange(Rand); }
+
+bool BFSChooser::plan(std::vector<uint64_t> &Prefix) {
+  Prefix.assign(SavedChoices.rbegin(), SavedChoices.rend());
+  return true;
+}
+
+bool BFSChooser::canChoose(uint64_t Choices, const std::vector<double> &) {
+  auto N = G.Slots.at(G.Nodes.at(Current).FirstChild + LastChoice).load();
+  if (N == BFSGuide::Untaken || N == BFSGuide::Reserved)
+    return true;
+  if (N == BFSGuide::Leaf)
+    return Choices == 0;
+  return Choices == G.Nodes.at(N).Degree;
+}
+
+void BFSChooser::replay(uint64_t Choices, const std::vector<double> &,
+                        uint64_t Choice) {
+  // within the prefix the saved choice wins, and it is the one that
+  // was made
+  auto Made = chooseInternal(Choices, [&]() { return Choice; });
+  assert(Made == Choice);
+  (void)Made;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -471,117 +1255,1116 @@ class WeightedSamplerChooser;
 class WeightedSamplerGuide : public Guide {
   friend WeightedSamplerChooser;
 
+  /*
+   * nodes live in an arena and refer to each other by index. where a
+   * node keeps its children depends on its branch factor, since most
+   * choices are narrow:
+   *
+   * - up to InlineLimit children are stored right in Kids
+   *
+   * - up to DenseLimit children are stored as BranchFactor
+   *   consecutive entries in the Slots arena, starting at Kids[0]
+   *
+   * - beyond that, Kids[0] is the index of a table in Sparse holding
+   *   just the children that exist, sorted by choice
+   *
+   * in the latter two cases Kids[1] is the index of the node's
+   * ChildSampler in Samplers. a missing child is None; since the root
+   * is node 0 and is nobody's child, 0 is free to serve as that marker
+   *
+   * if the guide is given a node budget, then when it goes over budget
+   * the least recently visited subtrees are collapsed: everything
+   * below such a node is freed and the node becomes a summary leaf
+   * whose SizeEstimate never changes again. storage that is freed
+   * goes onto free lists to be reused
+   *
+   * several choosers may descend the tree at once, from different
+   * threads. a node is set up by whichever chooser visits it first,
+   * and published by its State; children are installed with a
+   * compare-and-swap, so two choosers exploring the same edge end up
+   * sharing one child; and estimates and running sums are atomics
+   * that each chooser adjusts by its own delta. the only locks taken
+   * per choice guard the rare wide nodes' samplers and sparse tables.
+   * eviction needs the tree to itself, so it waits for the live
+   * choosers to finish. every live chooser holds TreeLock shared, so
+   * a thread may hold only one chooser from a guide at a time: it
+   * must not ask for a new chooser, or merge, while it still holds
+   * one. debug builds check this with a ThreadClaim
+   */
+  enum : uint8_t { Unvisited, Visiting, Visited };
+
   struct Node {
-    bool visited = false;
-    size_t BranchFactor;
-    std::vector<double> Weights;
-    std::unordered_map<uint64_t, std::unique_ptr<Node>> Children;
-    double SizeEstimate;
-
-    inline Node() {}
-
-    inline void visit(size_t n, const std::vector<double> &weights) {
-      assert(weights.size() == 0 || weights.size() == n);
-      if (this->visited) {
-        assert(n == this->BranchFactor);
-        return;
-      } else if (n == 0) {
-        this->BranchFactor = n;
-        this->visited = true;
-        this->SizeEstimate = 1.0;
-      } else {
-        this->BranchFactor = n;
-        this->visited = true;
-        this->SizeEstimate = n;
-        if (weights.size() > 0) {
-          double total = 0.0;
-          for (const auto x : weights)
-            total += x;
-          for (const auto x : weights)
-            this->Weights.push_back(x / total * n);
-        }
-      }
+    std::atomic<uint8_t> State{Unvisited};
+    // whether this node has been counted in its parent's running sums
+    std::atomic<bool> Counted{false};
+    bool Weighted = false;
+    bool Collapsed = false;
+    std::atomic<uint32_t> NumChildren{0};
+    uint64_t BranchFactor = 0;
+    std::atomic<uint32_t> Kids[2] = {};
+    // if Weighted, this node's normalized weights are BranchFactor
+    // consecutive entries of the Weights arena, starting here
+    uint32_t FirstWeight = 0;
+    // our position in our parent's ChildSampler, if it has one
+    uint32_t Ordinal = 0;
+    // value of the guide's Clock when a chooser last passed through
+    std::atomic<uint32_t> LastVisit{0};
+    std::atomic<double> SizeEstimate{0.0};
+    // running sums, over the children that have been counted, of
+    // weight * SizeEstimate and of weight, so that a change to one
+    // child's estimate can be propagated upwards in constant time
+    std::atomic<double> Total{0.0}, Occupied{0.0};
+    // the estimate that this node has most recently contributed to
+    // its parent's Total
+    std::atomic<double> Contributed{0.0};
+
+    // a node as it is saved in a snapshot
+    struct Record {
+      uint64_t BranchFactor;
+      double SizeEstimate, Total, Occupied, Contributed;
+      uint32_t NumChildren, Kids[2], FirstWeight, Ordinal, LastVisit;
+      uint8_t State, Counted, Weighted, Collapsed, Unused[4];
+    };
+
+    void save(Record &R) {
+      R.BranchFactor = BranchFactor;
+      R.SizeEstimate = SizeEstimate;
+      R.Total = Total;
+      R.Occupied = Occupied;
+      R.Contributed = Contributed;
+      R.NumChildren = NumChildren;
+      R.Kids[0] = Kids[0];
+      R.Kids[1] = Kids[1];
+      R.FirstWeight = FirstWeight;
+      R.Ordinal = Ordinal;
+      R.LastVisit = LastVisit;
+      R.State = State;
+      R.Counted = Counted;
+      R.Weighted = Weighted;
+      R.Collapsed = Collapsed;
     }
 
-    inline double weight(size_t i) {
-      assert(this->visited);
-      if (this->Weights.size() > 0) {
-        return this->Weights[i];
-      } else {
-        return 1.0;
-      }
+    void restore(const Record &R) {
+      BranchFactor = R.BranchFactor;
+      SizeEstimate = R.SizeEstimate;
+      Total = R.Total;
+      Occupied = R.Occupied;
+      Contributed = R.Contributed;
+      NumChildren = R.NumChildren;
+      Kids[0] = R.Kids[0];
+      Kids[1] = R.Kids[1];
+      FirstWeight = R.FirstWeight;
+      Ordinal = R.Ordinal;
+      LastVisit = R.LastVisit;
+      State = R.State;
+      Counted = R.Counted;
+      Weighted = R.Weighted;
+      Collapsed = R.Collapsed;
     }
 
-    inline void visit(size_t n) {
-      std::vector<double> empty;
-      this->visit(n, empty);
+    void reset() {
+      State = Unvisited;
+      Counted = false;
+      Weighted = Collapsed = false;
+      NumChildren = 0;
+      BranchFactor = 0;
+      Kids[0] = Kids[1] = None;
+      FirstWeight = Ordinal = 0;
+      LastVisit = 0;
+      SizeEstimate = Total = Occupied = Contributed = 0.0;
     }
+  };
+  static constexpr uint32_t Root = 0, None = 0;
+  static constexpr uint64_t InlineLimit = 2, DenseLimit = 1024;
+  // random probes for an unexplored child before falling back to
+  // counting them
+  static constexpr int ExploreProbes = 4;
 
-    inline void debug(size_t indent) {
-      assert(this->visited);
-      if (this->Children.size() == 0) {
-        std::cout << "Leaf node" << std::endl;
-        return;
+  /*
+   * a Fenwick tree over weight * SizeEstimate for each of a node's
+   * counted children, in the order the children were created, so
+   * that exploiting a wide node samples among its children in
+   * O(log k) time, and a changed estimate is folded in in O(log k)
+   * time, without allocating anything. callers hold Lock
+   */
+  class ChildSampler {
+    friend WeightedSamplerGuide;
+    // (choice, child) for each ordinal
+    std::vector<std::pair<uint64_t, uint32_t>> Members;
+    // Tree[j - 1] is the sum of the values of the ordinals in
+    // (j - lowbit(j), j]
+    std::vector<double> Tree;
+
+    static uint64_t lowbit(uint64_t j) { return j & -j; }
+
+    // sum of the values of the first j ordinals
+    double prefix(uint64_t j) {
+      double Sum = 0.0;
+      for (; j > 0; j -= lowbit(j))
+        Sum += Tree[j - 1];
+      return Sum;
+    }
+
+  public:
+    std::mutex Lock;
+
+    // add a member whose value is zero, returning its ordinal
+    uint32_t append(uint64_t Choice, uint32_t Child) {
+      uint64_t j = Members.size() + 1;
+      Members.push_back({Choice, Child});
+      Tree.push_back(prefix(j - 1) - prefix(j - lowbit(j)));
+      return j - 1;
+    }
+
+    void add(uint32_t Ordinal, double Delta) {
+      for (uint64_t j = Ordinal + 1; j <= Tree.size(); j += lowbit(j))
+        Tree[j - 1] += Delta;
+    }
+
+    double total() { return prefix(Tree.size()); }
+
+    /*
+     * the member in whose range R falls, when the members' values are
+     * laid end to end
+     */
+    const std::pair<uint64_t, uint32_t> &find(double R) {
+      assert(!Members.empty());
+      uint64_t Pos = 0, Step = 1;
+      while (Step * 2 <= Tree.size())
+        Step *= 2;
+      for (; Step > 0; Step /= 2) {
+        if (Pos + Step <= Tree.size() && Tree[Pos + Step - 1] <= R) {
+          Pos += Step;
+          R -= Tree[Pos - 1];
+        }
       }
+      // this can only happen by rounding
+      if (Pos >= Members.size())
+        Pos = Members.size() - 1;
+      return Members[Pos];
+    }
 
-      std::string indent_string(indent, ' ');
-      std::cout << "Node (size estimate " << this->SizeEstimate << ");"
-                << std::endl;
+    void clear() {
+      Members = {};
+      Tree = {};
     }
   };
 
-  std::unique_ptr<Node> Root;
-  std::unique_ptr<std::mt19937_64> Rand;
+  struct SparseTable {
+    std::mutex Lock;
+    // (choice, child), sorted by choice
+    std::vector<std::pair<uint64_t, uint32_t>> Children;
+  };
+
+  Arena<Node> Nodes;
+  Arena<std::atomic<uint32_t>> Slots;
+  Arena<double> Weights;
+  Arena<SparseTable> Sparse;
+  Arena<ChildSampler> Samplers;
+  // each chooser's PRNG is seeded with Seed plus the number of
+  // choosers made before it
+  const uint64_t Seed;
+  std::atomic<uint64_t> NumChoosers{0};
+
+  uint64_t MaxNodes = (uint64_t)-1;
+  std::atomic<uint32_t> Clock{0};
+  // held shared by every live chooser, and exclusively by eviction;
+  // Gate keeps new choosers out while eviction waits for the tree
+  std::shared_mutex TreeLock;
+  std::mutex Gate;
+
+  // protects all of the free lists
+  std::mutex FreeLock;
+  std::vector<uint32_t> FreeNodes, FreeSparse, FreeSamplers;
+  // ranges of slots and weights are handed out in power-of-two size
+  // classes, so that a freed range fits any later request in its
+  // class; FreeSlots[k] and FreeWeights[k] hold the starts of freed
+  // ranges of length 2^k
+  std::vector<std::vector<uint32_t>> FreeSlots, FreeWeights;
+
+  static inline void atomicAdd(std::atomic<double> &A, double Delta);
+  static inline unsigned sizeClass(uint64_t n);
+  template <typename T>
+  inline uint32_t allocOne(Arena<T> &A, std::vector<uint32_t> &Free);
+  template <typename T>
+  inline uint32_t allocRange(Arena<T> &A,
+                             std::vector<std::vector<uint32_t>> &Free,
+                             uint64_t n);
+  static inline void freeRange(std::vector<std::vector<uint32_t>> &Free,
+                               uint32_t Start, uint64_t n);
+  inline uint32_t allocNode();
+  inline void freeStorage(Node &N);
+  inline uint64_t collapse(uint32_t Index);
+  inline void evict();
+  template <typename F> inline void forEachChild(Node &N, F Fn);
+  inline bool visit(Node &N, uint64_t n, const std::vector<double> &weights);
+  inline double weight(Node &N, uint64_t i);
+  inline uint32_t child(Node &N, uint64_t i);
+  inline uint32_t addChild(Node &N, uint64_t i);
+  inline void childChanged(Node &Parent, uint64_t i, Node &Child);
+  inline std::pair<uint64_t, uint32_t> sampleChild(Node &N, double Unit);
+  inline uint64_t pickUnexplored(Node &N, std::mt19937_64 &R);
+  inline void debug(uint32_t N, size_t indent);
+  inline bool checkSnapshot(
+      SnapshotReader &R, const void *NodeData, uint64_t NumNodes,
+      const void *SlotData, uint64_t NumSlots, uint64_t NumWeights,
+      const std::vector<uint64_t> &SparseLengths,
+      const std::vector<uint64_t> &SparseBegin,
+      const std::vector<std::pair<uint64_t, uint32_t>> &SparseChildren,
+      uint64_t NumSamplers,
+      const std::vector<std::pair<uint64_t, uint32_t>> &Members);
 
 public:
-  inline WeightedSamplerGuide(uint64_t Seed) {
-    this->Root = std::make_unique<Node>();
-    this->Rand = std::make_unique<std::mt19937_64>(Seed);
+  inline WeightedSamplerGuide(uint64_t _Seed) : Seed(_Seed) {
+    this->Nodes.alloc(1);
   }
   inline WeightedSamplerGuide() : WeightedSamplerGuide(0) {}
   inline ~WeightedSamplerGuide() {}
   inline std::unique_ptr<Chooser> makeChooser() override;
-  inline void debugTree() { this->Root->debug(0); }
+  // cap the number of tree nodes kept in memory
+  inline void setMaxNodes(uint64_t Max) { this->MaxNodes = Max; }
+  inline uint64_t liveNodes() {
+    std::lock_guard<std::mutex> Guard(this->FreeLock);
+    return this->Nodes.size() - this->FreeNodes.size();
+  }
+  /*
+   * memory held by the arenas that store nodes' children and weights,
+   * including storage on the free lists; the nodes themselves are
+   * counted by liveNodes()
+   */
+  inline uint64_t childStorageBytes() {
+    return this->Slots.size() * sizeof(std::atomic<uint32_t>) +
+           this->Weights.size() * sizeof(double) +
+           this->Sparse.size() * sizeof(SparseTable) +
+           this->Samplers.size() * sizeof(ChildSampler);
+  }
+  // the estimated number of leaves in the whole tree
+  inline double sizeEstimate() { return this->Nodes.at(Root).SizeEstimate; }
+  inline uint32_t merge(WeightedSamplerGuide &From, uint32_t Since = 0);
+  // stamps every change made so far; see merge()
+  inline uint32_t clock() { return this->Clock; }
+  /*
+   * save the tree to a snapshot file, or restore it into a guide that
+   * has not made any choosers yet; there must be no live choosers.
+   * these return false, after printing a message, on error
+   */
+  inline bool saveSnapshot(const std::string &FileName);
+  inline bool loadSnapshot(const std::string &FileName);
+  inline void debugTree() { this->debug(Root, 0); }
   inline const std::string name() override { return "weighted sample"; }
 };
 
-class WeightedSamplerChooser : public Chooser {
-  WeightedSamplerGuide &G;
-  std::vector<WeightedSamplerGuide::Node *> Trail;
+void WeightedSamplerGuide::atomicAdd(std::atomic<double> &A, double Delta) {
+  double Old = A.load();
+  while (!A.compare_exchange_weak(Old, Old + Delta))
+    ;
+}
 
-public:
-  inline WeightedSamplerChooser(WeightedSamplerGuide &_G) : G(_G) {
-    this->Trail.push_back(this->G.Root.get());
+template <typename T>
+uint32_t WeightedSamplerGuide::allocOne(Arena<T> &A,
+                                        std::vector<uint32_t> &Free) {
+  {
+    std::lock_guard<std::mutex> Guard(this->FreeLock);
+    if (!Free.empty()) {
+      auto Index = Free.back();
+      Free.pop_back();
+      return Index;
+    }
   }
-  inline ~WeightedSamplerChooser() override {
-    this->Trail.back()->visit(0);
-    this->Trail.pop_back();
-    while (this->Trail.size() > 0) {
-      WeightedSamplerGuide::Node *last = this->Trail.back();
-      double occupied = 0.0;
-      double total = 0.0;
-      for (auto &t : last->Children) {
-        auto i = t.first;
-        auto &child = t.second;
-        if (child == nullptr)
-          continue;
-        auto weight = last->weight(i);
-        total += child->SizeEstimate * weight;
-        occupied += weight;
+  return A.alloc(1);
+}
+
+template <typename T>
+uint32_t
+WeightedSamplerGuide::allocRange(Arena<T> &A,
+                                 std::vector<std::vector<uint32_t>> &Free,
+                                 uint64_t n) {
+  auto k = sizeClass(n);
+  {
+    std::lock_guard<std::mutex> Guard(this->FreeLock);
+    if (k < Free.size() && !Free[k].empty()) {
+      auto Start = Free[k].back();
+      Free[k].pop_back();
+      return Start;
+    }
+  }
+  return A.alloc((uint64_t)1 << k);
+}
+
+// the smallest k such that n <= 2^k
+unsigned WeightedSamplerGuide::sizeClass(uint64_t n) {
+  return n <= 1 ? 0 : 64 - __builtin_clzll(n - 1);
+}
+
+void WeightedSamplerGuide::freeRange(std::vector<std::vector<uint32_t>> &Free,
+                                     uint32_t Start, uint64_t n) {
+  auto k = sizeClass(n);
+  if (k >= Free.size())
+    Free.resize(k + 1);
+  Free[k].push_back(Start);
+}
+
+uint32_t WeightedSamplerGuide::allocNode() {
+  return this->allocOne(this->Nodes, this->FreeNodes);
+}
+
+/*
+ * release N's children and weights, but not the children's subtrees
+ */
+void WeightedSamplerGuide::freeStorage(Node &N) {
+  // a summary leaf gave its storage back when it was collapsed
+  if (N.Collapsed)
+    return;
+  std::lock_guard<std::mutex> Guard(this->FreeLock);
+  if (N.BranchFactor > InlineLimit && N.BranchFactor <= DenseLimit) {
+    for (uint64_t i = 0; i < N.BranchFactor; ++i)
+      this->Slots.at(N.Kids[0] + i) = None;
+    freeRange(this->FreeSlots, N.Kids[0], N.BranchFactor);
+  } else if (N.BranchFactor > DenseLimit) {
+    this->Sparse.at(N.Kids[0]).Children = {};
+    this->FreeSparse.push_back(N.Kids[0]);
+  }
+  if (N.BranchFactor > InlineLimit) {
+    this->Samplers.at(N.Kids[1]).clear();
+    this->FreeSamplers.push_back(N.Kids[1]);
+  }
+  if (N.Weighted)
+    freeRange(this->FreeWeights, N.FirstWeight, N.BranchFactor);
+  N.Kids[0] = N.Kids[1] = None;
+  N.Weighted = false;
+  N.NumChildren = 0;
+}
+
+/*
+ * free everything below the given node, turning it into a summary
+ * leaf that keeps its SizeEstimate; returns the number of nodes freed
+ */
+uint64_t WeightedSamplerGuide::collapse(uint32_t Index) {
+  uint64_t Freed = 0;
+  std::vector<uint32_t> Stack{Index};
+  while (!Stack.empty()) {
+    auto I = Stack.back();
+    Stack.pop_back();
+    auto &N = this->Nodes.at(I);
+    this->forEachChild(N, [&](uint64_t, uint32_t C) { Stack.push_back(C); });
+    this->freeStorage(N);
+    if (I != Index) {
+      N.reset();
+      std::lock_guard<std::mutex> Guard(this->FreeLock);
+      this->FreeNodes.push_back(I);
+      ++Freed;
+    }
+  }
+  this->Nodes.at(Index).Collapsed = true;
+  return Freed;
+}
+
+/*
+ * collapse the least recently visited subtrees until we're a quarter
+ * of the way under budget, so that evictions don't happen on every
+ * sample. the caller has the tree to itself
+ */
+void WeightedSamplerGuide::evict() {
+  uint64_t Target = this->MaxNodes - this->MaxNodes / 4;
+  uint32_t Now = this->Clock;
+  std::vector<std::pair<uint32_t, uint32_t>> Candidates;
+  for (uint64_t I = Root + 1; I < this->Nodes.size(); ++I) {
+    auto &N = this->Nodes.at(I);
+    if (N.State == Visited && N.NumChildren > 0)
+      Candidates.push_back({Now - N.LastVisit, I});
+  }
+  std::sort(Candidates.begin(), Candidates.end(),
+            [](auto &A, auto &B) { return A.first > B.first; });
+  for (auto [Age, I] : Candidates) {
+    if (this->liveNodes() <= Target)
+      break;
+    auto &N = this->Nodes.at(I);
+    // might already be gone, inside a subtree we collapsed earlier
+    if (N.State == Visited && N.NumChildren > 0)
+      this->collapse(I);
+  }
+}
+
+/*
+ * call Fn(i, child) for every child of N that exists
+ */
+template <typename F> void WeightedSamplerGuide::forEachChild(Node &N, F Fn) {
+  if (N.NumChildren == 0)
+    return;
+  if (N.BranchFactor > DenseLimit) {
+    for (auto &P : this->Sparse.at(N.Kids[0]).Children)
+      Fn(P.first, P.second);
+    return;
+  }
+  for (uint64_t i = 0; i < N.BranchFactor; ++i) {
+    auto C = this->child(N, i);
+    if (C != None)
+      Fn(i, C);
+  }
+}
+
+/*
+ * set N up as a node with n children, unless it already is one; returns
+ * false if it was already set up with a different number
+ */
+bool WeightedSamplerGuide::visit(Node &N, uint64_t n,
+                                 const std::vector<double> &weights) {
+  assert(weights.size() == 0 || weights.size() == n);
+  uint8_t S = Unvisited;
+  if (!N.State.compare_exchange_strong(S, Visiting)) {
+    // someone else got here first; wait until they've set the node up
+    while (N.State != Visited)
+      std::this_thread::yield();
+    return n == N.BranchFactor;
+  }
+  N.BranchFactor = n;
+  if (n == 0) {
+    N.SizeEstimate = 1.0;
+    N.State = Visited;
+    return true;
+  }
+  N.SizeEstimate = n;
+  if (n > InlineLimit && n <= DenseLimit) {
+    N.Kids[0] = allocRange(this->Slots, this->FreeSlots, n);
+  } else if (n > DenseLimit) {
+    N.Kids[0] = this->allocOne(this->Sparse, this->FreeSparse);
+  }
+  if (n > InlineLimit) {
+    N.Kids[1] = this->allocOne(this->Samplers, this->FreeSamplers);
+  }
+  if (weights.size() > 0) {
+    double total = 0.0;
+    for (const auto x : weights)
+      total += x;
+    N.Weighted = true;
+    N.FirstWeight = allocRange(this->Weights, this->FreeWeights, n);
+    for (uint64_t i = 0; i < n; ++i)
+      this->Weights.at(N.FirstWeight + i) = weights[i] / total * n;
+  }
+  N.State = Visited;
+  return true;
+}
+
+double WeightedSamplerGuide::weight(Node &N, uint64_t i) {
+  assert(N.State == Visited);
+  if (N.Weighted) {
+    return this->Weights.at(N.FirstWeight + i);
+  } else {
+    return 1.0;
+  }
+}
+
+uint32_t WeightedSamplerGuide::child(Node &N, uint64_t i) {
+  assert(N.State == Visited && !N.Collapsed && i < N.BranchFactor);
+  if (N.BranchFactor <= InlineLimit)
+    return N.Kids[i];
+  if (N.BranchFactor <= DenseLimit)
+    return this->Slots.at(N.Kids[0] + i);
+  auto &Table = this->Sparse.at(N.Kids[0]);
+  std::lock_guard<std::mutex> Guard(Table.Lock);
+  auto It = std::lower_bound(Table.Children.begin(), Table.Children.end(),
+                             std::make_pair(i, (uint32_t)0));
+  if (It == Table.Children.end() || It->first != i)
+    return None;
+  return It->second;
+}
+
+/*
+ * return the i'th child of N, creating it if it doesn't exist yet. if
+ * another chooser creates it at the same time, we both get theirs
+ */
+uint32_t WeightedSamplerGuide::addChild(Node &N, uint64_t i) {
+  auto C = this->allocNode();
+  uint32_t Existing = None;
+  // a wide node's sampler lock is held until the new child has its
+  // ordinal, so nobody can fold its estimate in before then
+  std::unique_lock<std::mutex> SamplerGuard;
+  if (N.BranchFactor > InlineLimit)
+    SamplerGuard =
+        std::unique_lock<std::mutex>(this->Samplers.at(N.Kids[1]).Lock);
+  if (N.BranchFactor <= InlineLimit) {
+    N.Kids[i].compare_exchange_strong(Existing, C);
+  } else if (N.BranchFactor <= DenseLimit) {
+    this->Slots.at(N.Kids[0] + i).compare_exchange_strong(Existing, C);
+  } else {
+    auto &Table = this->Sparse.at(N.Kids[0]);
+    std::lock_guard<std::mutex> Guard(Table.Lock);
+    auto P = std::make_pair(i, C);
+    auto It =
+        std::lower_bound(Table.Children.begin(), Table.Children.end(),
+                         std::make_pair(i, (uint32_t)0));
+    if (It != Table.Children.end() && It->first == i)
+      Existing = It->second;
+    else
+      Table.Children.insert(It, P);
+  }
+  if (Existing != None) {
+    std::lock_guard<std::mutex> Guard(this->FreeLock);
+    this->FreeNodes.push_back(C);
+    return Existing;
+  }
+  if (N.BranchFactor > InlineLimit)
+    this->Nodes.at(C).Ordinal = this->Samplers.at(N.Kids[1]).append(i, C);
+  N.NumChildren++;
+  return C;
+}
+
+/*
+ * fold a change in the estimate of Child, which is the i'th child of
+ * Parent, into Parent's running sums and sampler. several choosers may
+ * do this at once: each one claims the difference between the
+ * child's estimate and what was last contributed, so every change is
+ * counted exactly once
+ */
+void WeightedSamplerGuide::childChanged(Node &Parent, uint64_t i,
+                                        Node &Child) {
+  auto weight = this->weight(Parent, i);
+  double Estimate = Child.SizeEstimate;
+  double Delta = (Estimate - Child.Contributed.exchange(Estimate)) * weight;
+  if (!Child.Counted.exchange(true))
+    atomicAdd(Parent.Occupied, weight);
+  atomicAdd(Parent.Total, Delta);
+  if (Parent.BranchFactor > InlineLimit) {
+    auto &S = this->Samplers.at(Parent.Kids[1]);
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    S.add(Child.Ordinal, Delta);
+  }
+}
+
+/*
+ * pick one of N's existing children with probability proportional to
+ * weight * SizeEstimate, given a uniform draw from [0, 1)
+ */
+std::pair<uint64_t, uint32_t> WeightedSamplerGuide::sampleChild(Node &N,
+                                                                double Unit) {
+  assert(N.NumChildren > 0);
+  if (N.BranchFactor > InlineLimit) {
+    auto &S = this->Samplers.at(N.Kids[1]);
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    return S.find(Unit * S.total());
+  }
+  uint32_t K[InlineLimit] = {};
+  double W[InlineLimit] = {};
+  double Sum = 0.0;
+  for (uint64_t i = 0; i < N.BranchFactor; ++i) {
+    K[i] = N.Kids[i];
+    if (K[i] != None)
+      W[i] = this->weight(N, i) * this->Nodes.at(K[i]).SizeEstimate;
+    Sum += W[i];
+  }
+  double R = Unit * Sum;
+  for (uint64_t i = 0; i < N.BranchFactor; ++i) {
+    if (K[i] == None)
+      continue;
+    if (R < W[i])
+      return {i, K[i]};
+    R -= W[i];
+  }
+  // rounding left us past the end, so take the last child
+  for (uint64_t i = N.BranchFactor; i-- > 0;)
+    if (K[i] != None)
+      return {i, K[i]};
+  assert(false);
+  return {0, None};
+}
+
+/*
+ * pick one of N's missing children, with probability proportional to
+ * its weight, in time bounded by the branch factor. when few children
+ * have been explored, a handful of random probes almost always finds
+ * one; failing that we count the missing children and take one by
+ * rank. with other choosers about, the child may no longer be missing
+ * by the time we add it, which is harmless
+ */
+uint64_t WeightedSamplerGuide::pickUnexplored(Node &N, std::mt19937_64 &R) {
+  if (N.Weighted) {
+    double Missing = 0.0;
+    for (uint64_t i = 0; i < N.BranchFactor; ++i)
+      if (this->child(N, i) == None)
+        Missing += this->weight(N, i);
+    std::uniform_real_distribution<double> Dist(0.0, Missing);
+    double X = Dist(R);
+    uint64_t Last = 0;
+    for (uint64_t i = 0; i < N.BranchFactor; ++i) {
+      if (this->child(N, i) != None)
+        continue;
+      Last = i;
+      auto W = this->weight(N, i);
+      if (X < W)
+        return i;
+      X -= W;
+    }
+    // rounding left us past the end
+    return Last;
+  }
+
+  std::uniform_int_distribution<uint64_t> Probe(0, N.BranchFactor - 1);
+  for (int i = 0; i < ExploreProbes; ++i) {
+    auto Choice = Probe(R);
+    if (this->child(N, Choice) == None)
+      return Choice;
+  }
+
+  if (N.BranchFactor > DenseLimit) {
+    auto &Table = this->Sparse.at(N.Kids[0]);
+    std::lock_guard<std::mutex> Guard(Table.Lock);
+    // another chooser beat us to the last one
+    if (Table.Children.size() >= N.BranchFactor)
+      return Probe(R);
+    std::uniform_int_distribution<uint64_t> Rank(
+        0, N.BranchFactor - Table.Children.size() - 1);
+    // the Rank'th missing choice is Rank plus the number of existing
+    // children below it
+    uint64_t Choice = Rank(R);
+    for (auto &P : Table.Children) {
+      if (P.first > Choice)
+        break;
+      ++Choice;
+    }
+    return Choice;
+  }
+  std::vector<uint64_t> Missing;
+  for (uint64_t i = 0; i < N.BranchFactor; ++i)
+    if (this->child(N, i) == None)
+      Missing.push_back(i);
+  // another chooser beat us to the last one
+  if (Missing.empty())
+    return Probe(R);
+  std::uniform_int_distribution<uint64_t> Rank(0, Missing.size() - 1);
+  return Missing[Rank(R)];
+}
+
+/*
+ * fold everything that From has learned into this tree: we end up
+ * with the union of the two trees' explored nodes, and estimates
+ * recomputed from that union. since an estimate only depends on the
+ * nodes below it, merging the same tree twice changes nothing. where
+ * either side has collapsed a node into a summary leaf, whichever side
+ * kept more detail wins.
+ *
+ * every node that a chooser or a merge changes is stamped with the
+ * guide's clock, and so are its ancestors, so a merge can skip the
+ * subtrees of From that haven't changed since an earlier merge from
+ * it: pass the value that merge returned as Since. this tree is taken
+ * over for the duration, so the merge waits for our live choosers to
+ * finish; From is only read, and its choosers can carry on
+ */
+uint32_t WeightedSamplerGuide::merge(WeightedSamplerGuide &From,
+                                     uint32_t Since) {
+  assert(&From != this);
+  assert(!ThreadClaim::held(this) && !ThreadClaim::held(&From));
+  std::lock_guard<std::mutex> Guard(this->Gate);
+  // lock in a fixed order, so that merges in opposite directions
+  // can't deadlock
+  std::unique_lock<std::shared_mutex> Exclusive(this->TreeLock,
+                                                std::defer_lock);
+  std::shared_lock<std::shared_mutex> Shared(From.TreeLock, std::defer_lock);
+  if (this < &From) {
+    Exclusive.lock();
+    Shared.lock();
+  } else {
+    Shared.lock();
+    Exclusive.lock();
+  }
+  // whatever From's choosers change from here on gets a later stamp
+  uint32_t Until = From.Clock++;
+  uint32_t Stamp = ++this->Clock;
+
+  struct Step {
+    /*
+     * Merge: merge From's node into To's. Fold: Child's estimate is
+     * final, so fold it into the running sums of its parent To. Done:
+     * all of To's merged children have been folded in
+     */
+    enum { Merge, Fold, Done } Kind;
+    uint32_t To, From, Child;
+    uint64_t Choice;
+  };
+  std::vector<Step> Stack{{Step::Merge, Root, Root, None, 0}};
+  std::vector<double> NewWeights;
+  std::vector<std::pair<uint64_t, uint32_t>> Kids;
+  while (!Stack.empty()) {
+    auto P = Stack.back();
+    Stack.pop_back();
+    auto &T = this->Nodes.at(P.To);
+
+    if (P.Kind == Step::Fold) {
+      auto &Child = this->Nodes.at(P.Child);
+      if (Child.State == Visited)
+        this->childChanged(T, P.Choice, Child);
+      continue;
+    }
+    if (P.Kind == Step::Done) {
+      if (T.Occupied > 0)
+        T.SizeEstimate = T.NumChildren * T.Total / T.Occupied;
+      continue;
+    }
+
+    auto &F = From.Nodes.at(P.From);
+    if (F.State != Visited || T.Collapsed)
+      continue;
+    T.LastVisit = Stamp;
+    if (T.State != Visited) {
+      NewWeights.clear();
+      if (F.Weighted)
+        for (uint64_t i = 0; i < F.BranchFactor; ++i)
+          NewWeights.push_back(From.Weights.at(F.FirstWeight + i));
+      this->visit(T, F.BranchFactor, NewWeights);
+    }
+    assert(T.BranchFactor == F.BranchFactor);
+
+    if (F.Collapsed) {
+      if (T.NumChildren == 0 && T.BranchFactor > 0) {
+        this->freeStorage(T);
+        T.Collapsed = true;
+        T.SizeEstimate = F.SizeEstimate.load();
+      }
+      continue;
+    }
+
+    Stack.push_back({Step::Done, P.To, None, None, 0});
+    Kids.clear();
+    if (F.BranchFactor > DenseLimit) {
+      // From's choosers may be adding to the table
+      auto &Table = From.Sparse.at(F.Kids[0]);
+      std::lock_guard<std::mutex> TableGuard(Table.Lock);
+      Kids = Table.Children;
+    } else {
+      From.forEachChild(F, [&](uint64_t i, uint32_t C) {
+        Kids.push_back({i, C});
+      });
+    }
+    // backwards, so that children are merged and folded in in order
+    for (auto It = Kids.rbegin(); It != Kids.rend(); ++It) {
+      auto [i, C] = *It;
+      auto &FC = From.Nodes.at(C);
+      if (FC.State != Visited || FC.LastVisit <= Since)
+        continue;
+      auto Ours = this->child(T, i);
+      if (Ours == None)
+        Ours = this->addChild(T, i);
+      Stack.push_back({Step::Fold, P.To, None, Ours, i});
+      Stack.push_back({Step::Merge, Ours, C, None, 0});
+    }
+  }
+  return Until;
+}
+
+/*
+ * the arenas of nodes, slots and weights are saved as they are. sparse
+ * tables and samplers hold vectors, so each of those is flattened into
+ * a section of lengths and a section of the concatenated contents; the
+ * free lists of ranges are flattened into (length, start) pairs
+ */
+bool WeightedSamplerGuide::saveSnapshot(const std::string &FileName) {
+  std::lock_guard<std::mutex> Guard(this->Gate);
+  std::unique_lock<std::shared_mutex> Exclusive(this->TreeLock);
+  SnapshotWriter W(FileName, SnapshotKind::WEIGHTED_SAMPLER,
+                   {this->NumChoosers, this->Clock});
+  W.section<Node::Record>(this->Nodes,
+                          [](Node &N, Node::Record &Rec) { N.save(Rec); });
+  W.section<uint32_t>(this->Slots, [](std::atomic<uint32_t> &S,
+                                      uint32_t &Rec) { Rec = S.load(); });
+  W.section(this->Weights);
+
+  std::vector<uint64_t> Lengths;
+  std::vector<std::pair<uint64_t, uint32_t>> Children;
+  for (uint64_t I = 0; I < this->Sparse.size(); ++I) {
+    auto &Table = this->Sparse.at(I).Children;
+    Lengths.push_back(Table.size());
+    Children.insert(Children.end(), Table.begin(), Table.end());
+  }
+  W.section(Lengths);
+  W.section(Children);
+
+  Lengths.clear();
+  Children.clear();
+  std::vector<double> Trees;
+  for (uint64_t I = 0; I < this->Samplers.size(); ++I) {
+    auto &S = this->Samplers.at(I);
+    Lengths.push_back(S.Members.size());
+    Children.insert(Children.end(), S.Members.begin(), S.Members.end());
+    Trees.insert(Trees.end(), S.Tree.begin(), S.Tree.end());
+  }
+  W.section(Lengths);
+  W.section(Children);
+  W.section(Trees);
+
+  W.section(this->FreeNodes);
+  W.section(this->FreeSparse);
+  W.section(this->FreeSamplers);
+  for (auto *Free : {&this->FreeSlots, &this->FreeWeights}) {
+    std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+    for (uint64_t k = 0; k < Free->size(); ++k)
+      for (auto Start : Free->at(k))
+        Ranges.push_back({(uint64_t)1 << k, Start});
+    W.section(Ranges);
+  }
+  return W.finish();
+}
+
+/*
+ * check that every index in a snapshot's nodes is in range: each node
+ * is either unexplored, or a leaf, or has its children where its
+ * branch factor says they are; and the children are real nodes, none
+ * of them the root, and each the child of only one parent
+ */
+bool WeightedSamplerGuide::checkSnapshot(
+    SnapshotReader &R, const void *NodeData, uint64_t NumNodes,
+    const void *SlotData, uint64_t NumSlots, uint64_t NumWeights,
+    const std::vector<uint64_t> &SparseLengths,
+    const std::vector<uint64_t> &SparseBegin,
+    const std::vector<std::pair<uint64_t, uint32_t>> &SparseChildren,
+    uint64_t NumSamplers,
+    const std::vector<std::pair<uint64_t, uint32_t>> &Members) {
+  std::vector<bool> HasParent(NumNodes);
+  auto claim = [&](uint64_t C) {
+    if (C == Root || C >= NumNodes || HasParent[C])
+      return false;
+    HasParent[C] = true;
+    return true;
+  };
+  for (uint64_t I = 0; I < NumNodes; ++I) {
+    auto N = SnapshotReader::record<Node::Record>(NodeData, I);
+    uint64_t BF = N.BranchFactor;
+    if ((N.State != Unvisited && N.State != Visited) ||
+        N.NumChildren > BF ||
+        (N.Weighted && (uint64_t)N.FirstWeight + BF > NumWeights))
+      return R.corrupt("node");
+    if (N.State == Unvisited || N.Collapsed || BF == 0) {
+      if (N.Kids[0] != None || N.Kids[1] != None || N.NumChildren != 0)
+        return R.corrupt("node");
+    } else if (BF <= InlineLimit) {
+      for (uint64_t i = 0; i < InlineLimit; ++i)
+        if (N.Kids[i] != None && (i >= BF || !claim(N.Kids[i])))
+          return R.corrupt("node");
+    } else {
+      if (N.Kids[1] >= NumSamplers)
+        return R.corrupt("node");
+      if (BF <= DenseLimit) {
+        if ((uint64_t)N.Kids[0] + BF > NumSlots)
+          return R.corrupt("node");
+        for (uint64_t i = 0; i < BF; ++i) {
+          auto C = SnapshotReader::record<uint32_t>(SlotData, N.Kids[0] + i);
+          if (C != None && !claim(C))
+            return R.corrupt("slot");
+        }
+      } else {
+        if (N.Kids[0] >= SparseLengths.size())
+          return R.corrupt("node");
+        auto First = SparseChildren.begin() + SparseBegin[N.Kids[0]];
+        for (auto It = First; It != First + SparseLengths[N.Kids[0]]; ++It)
+          if (It->first >= BF ||
+              (It != First && It->first <= (It - 1)->first) ||
+              !claim(It->second))
+            return R.corrupt("sparse table");
       }
+    }
+  }
+  for (auto [Choice, C] : Members)
+    if (C == Root || C >= NumNodes)
+      return R.corrupt("sampler");
+  return true;
+}
+
+bool WeightedSamplerGuide::loadSnapshot(const std::string &FileName) {
+  std::lock_guard<std::mutex> Guard(this->Gate);
+  std::unique_lock<std::shared_mutex> Exclusive(this->TreeLock);
+  assert(this->Nodes.size() == 1 && this->Nodes.at(Root).State == Unvisited);
+  SnapshotReader R(FileName, SnapshotKind::WEIGHTED_SAMPLER, 2);
+  uint64_t NumNodes, NumSlots, NumWeights;
+  auto *NodeData = R.section(sizeof(Node::Record), NumNodes);
+  auto *SlotData = R.section(sizeof(uint32_t), NumSlots);
+  auto *WeightData = R.section(sizeof(double), NumWeights);
+  std::vector<uint64_t> SparseLengths, SamplerLengths;
+  std::vector<std::pair<uint64_t, uint32_t>> SparseChildren, Members;
+  std::vector<double> Trees;
+  std::vector<uint32_t> FreeNodeList, FreeSparseList, FreeSamplerList;
+  std::vector<std::pair<uint32_t, uint32_t>> FreeSlotRanges,
+      FreeWeightRanges;
+  if (!NodeData || !SlotData || !WeightData || !R.section(SparseLengths) ||
+      !R.section(SparseChildren) || !R.section(SamplerLengths) ||
+      !R.section(Members) || !R.section(Trees) ||
+      !R.section(FreeNodeList) || !R.section(FreeSparseList) ||
+      !R.section(FreeSamplerList) || !R.section(FreeSlotRanges) ||
+      !R.section(FreeWeightRanges))
+    return false;
+  // where each sparse table's children start in SparseChildren
+  std::vector<uint64_t> SparseBegin;
+  uint64_t SparseTotal = 0, SamplerTotal = 0;
+  for (auto L : SparseLengths) {
+    if (L > SparseChildren.size() - SparseTotal)
+      return R.corrupt("sparse table");
+    SparseBegin.push_back(SparseTotal);
+    SparseTotal += L;
+  }
+  for (auto L : SamplerLengths) {
+    if (L > Members.size() - SamplerTotal)
+      return R.corrupt("sampler");
+    SamplerTotal += L;
+  }
+  if (NumNodes < 1 || SparseTotal != SparseChildren.size() ||
+      SamplerTotal != Members.size() || SamplerTotal != Trees.size())
+    return R.corrupt("header");
+  if (!this->checkSnapshot(R, NodeData, NumNodes, SlotData, NumSlots,
+                           NumWeights, SparseLengths, SparseBegin,
+                           SparseChildren, SamplerLengths.size(), Members))
+    return false;
+  for (auto I : FreeNodeList)
+    if (I == Root || I >= NumNodes)
+      return R.corrupt("free list");
+  for (auto I : FreeSparseList)
+    if (I >= SparseLengths.size())
+      return R.corrupt("free list");
+  for (auto I : FreeSamplerList)
+    if (I >= SamplerLengths.size())
+      return R.corrupt("free list");
+  for (auto [Ranges, Size] : {std::make_pair(&FreeSlotRanges, NumSlots),
+                              std::make_pair(&FreeWeightRanges, NumWeights)})
+    for (auto [n, Start] : *Ranges)
+      if (n == 0 || (n & (n - 1)) != 0 || (uint64_t)Start + n > Size)
+        return R.corrupt("free list");
+
+  this->Nodes.alloc(NumNodes - this->Nodes.size());
+  for (uint64_t I = 0; I < NumNodes; ++I)
+    this->Nodes.at(I).restore(
+        SnapshotReader::record<Node::Record>(NodeData, I));
+  this->Slots.alloc(NumSlots);
+  for (uint64_t I = 0; I < NumSlots; ++I)
+    this->Slots.at(I) = SnapshotReader::record<uint32_t>(SlotData, I);
+  this->Weights.assign(WeightData, NumWeights);
+
+  auto Next = SparseChildren.begin();
+  this->Sparse.alloc(SparseLengths.size());
+  for (uint64_t I = 0; I < SparseLengths.size(); ++I) {
+    this->Sparse.at(I).Children.assign(Next, Next + SparseLengths[I]);
+    Next += SparseLengths[I];
+  }
+  uint64_t Pos = 0;
+  this->Samplers.alloc(SamplerLengths.size());
+  for (uint64_t I = 0; I < SamplerLengths.size(); ++I) {
+    auto &S = this->Samplers.at(I);
+    S.Members.assign(Members.begin() + Pos,
+                     Members.begin() + Pos + SamplerLengths[I]);
+    S.Tree.assign(Trees.begin() + Pos, Trees.begin() + Pos + SamplerLengths[I]);
+    Pos += SamplerLengths[I];
+  }
+
+  this->FreeNodes = std::move(FreeNodeList);
+  this->FreeSparse = std::move(FreeSparseList);
+  this->FreeSamplers = std::move(FreeSamplerList);
+  for (auto [n, Start] : FreeSlotRanges)
+    freeRange(this->FreeSlots, Start, n);
+  for (auto [n, Start] : FreeWeightRanges)
+    freeRange(this->FreeWeights, Start, n);
+  this->NumChoosers = R.Scalars[0];
+  this->Clock = R.Scalars[1];
+  return true;
+}
+
+void WeightedSamplerGuide::debug(uint32_t Index, size_t indent) {
+  auto &N = this->Nodes.at(Index);
+  assert(N.State == Visited);
+  if (N.NumChildren == 0) {
+    std::cout << "Leaf node" << std::endl;
+    return;
+  }
 
-      last->SizeEstimate = last->Children.size() * total / occupied;
+  std::string indent_string(indent, ' ');
+  std::cout << "Node (size estimate " << N.SizeEstimate << ");" << std::endl;
+}
+
+class WeightedSamplerChooser : public Chooser {
+  WeightedSamplerGuide &G;
+  ThreadClaim Claim;
+  std::shared_lock<std::shared_mutex> TreeGuard;
+  std::mt19937_64 Rand;
+  std::vector<uint32_t> Trail;
+  // Path[i] is the choice that was made at Trail[i]
+  std::vector<uint64_t> Path;
+  // set once we've passed through a collapsed node; below there we
+  // just make random choices and don't learn anything
+  bool OffTree = false;
+  bool Abandoned = false;
+
+  inline void enter(uint32_t Index) {
+    this->G.Nodes.at(Index).LastVisit = this->G.Clock.load();
+    this->Trail.push_back(Index);
+  }
+
+  // going on would index past the node's children
+  [[noreturn]] inline void differentChoices() {
+    std::cerr << "FATAL ERROR: Reached same node again, but different "
+                 "number of choices this time\n\n";
+    exit(-1);
+  }
+
+  // see the discussion in choose()
+  inline bool shouldExplore(WeightedSamplerGuide::Node &N) {
+    std::uniform_real_distribution<double> unif(0.0, 1.0);
+    uint32_t NumChildren = N.NumChildren;
+    return NumChildren < N.BranchFactor &&
+           (NumChildren <= 5 || unif(this->Rand) <= 0.1);
+  }
 
+public:
+  inline WeightedSamplerChooser(WeightedSamplerGuide &_G, uint64_t Seed)
+      : G(_G), Claim(&_G), TreeGuard(_G.TreeLock), Rand(Seed) {
+    this->enter(WeightedSamplerGuide::Root);
+  }
+  inline ~WeightedSamplerChooser() override {
+    std::vector<double> empty;
+    auto &End = this->G.Nodes.at(this->Trail.back());
+    if (this->Abandoned) {
+      // we don't know what's below where we stopped, so it isn't a
+      // leaf; but if nobody has been there, give it a placeholder
+      // estimate, or it will never be sampled
+      double Zero = 0.0;
+      if (End.State == WeightedSamplerGuide::Unvisited)
+        End.SizeEstimate.compare_exchange_strong(Zero, 1.0);
+    } else if (!this->OffTree) {
+      bool IsLeaf = this->G.visit(End, 0, empty);
+      assert(IsLeaf);
+      (void)IsLeaf;
+    }
+    // only the nodes on our trail can have changed their estimates,
+    // so we just push each one's change into its parent's running
+    // sums on the way back up. a merge that read the tree while we
+    // were running can have missed some of our changes, so the trail
+    // is stamped again, for the next merge to pick them up
+    while (this->Trail.size() > 1) {
+      auto &child = this->G.Nodes.at(this->Trail.back());
+      child.LastVisit = this->G.Clock.load();
       this->Trail.pop_back();
+      auto &last = this->G.Nodes.at(this->Trail.back());
+      this->G.childChanged(last, this->Path.back(), child);
+      this->Path.pop_back();
+
+      last.SizeEstimate = last.NumChildren * last.Total / last.Occupied;
     }
   };
 
   inline uint64_t choose(uint64_t Choices, const std::vector<double> &Weights) {
-    WeightedSamplerGuide::Node *current = this->Trail.back();
-    current->visit(Choices, Weights);
+    if (this->OffTree) {
+      if (Weights.size() > 0) {
+        std::discrete_distribution<uint64_t> Dist(Weights.begin(),
+                                                  Weights.end());
+        return Dist(this->Rand);
+      }
+      std::uniform_int_distribution<uint64_t> Dist(0, Choices - 1);
+      return Dist(this->Rand);
+    }
+
+    auto &current = this->G.Nodes.at(this->Trail.back());
+    if (!this->G.visit(current, Choices, Weights))
+      this->differentChoices();
+    if (current.Collapsed) {
+      this->OffTree = true;
+      return this->choose(Choices, Weights);
+    }
 
-    size_t result;
-    WeightedSamplerGuide::Node *next_node;
+    uint64_t result;
+    uint32_t next_node;
     std::uniform_real_distribution<double> unif(0.0, 1.0);
 
     // When we visit a node we have to choose between whether to visit
@@ -602,58 +2385,19 @@ public:
     // rapidly at first and then once we have a decent number of nodes to
     // compare, we switch to a more leisurely strategy where we prefer to
     // exploit existing nodes but explore occasionally.
-    bool explore =
-        (current->Children.size() < current->BranchFactor &&
-         (current->Children.size() <= 5 || unif(*G.Rand.get()) <= 0.1));
-
-    if (explore) {
-      if (current->Weights.size() > 0) {
-        std::discrete_distribution<uint64_t> Dist(current->Weights.begin(),
-                                                  current->Weights.end());
-        while (true) {
-          result = Dist(*G.Rand.get());
-          if (current->Children[result] == nullptr)
-            break;
-        }
-      } else {
-        std::uniform_int_distribution<uint64_t> Dist(0,
-                                                     current->BranchFactor - 1);
-        while (true) {
-          result = Dist(*G.Rand.get());
-          if (current->Children[result] == nullptr)
-            break;
-        }
-      }
-
-      next_node = (current->Children[result] =
-                       std::make_unique<WeightedSamplerGuide::Node>())
-                      .get();
+    if (this->shouldExplore(current)) {
+      result = this->G.pickUnexplored(current, this->Rand);
+      next_node = this->G.addChild(current, result);
 
     } else {
-      std::vector<uint64_t> results;
-      std::vector<double> weights;
-
-      for (auto &t : current->Children) {
-        auto value = t.first;
-        auto &child = t.second;
-        if (child == nullptr)
-          continue;
-        results.push_back(value);
-        weights.push_back(current->weight(value) * child->SizeEstimate);
-      }
-
-      std::discrete_distribution<size_t> Dist(weights.begin(), weights.end());
-
-      auto i = Dist(*G.Rand.get());
-
-      result = results[i];
-
-      next_node = current->Children[result].get();
+      std::tie(result, next_node) =
+          this->G.sampleChild(current, unif(this->Rand));
     }
 
-    assert(next_node != nullptr);
+    assert(next_node != WeightedSamplerGuide::None);
 
-    this->Trail.push_back(next_node);
+    this->enter(next_node);
+    this->Path.push_back(result);
     return result;
   };
 
@@ -668,10 +2412,26 @@ public:
   inline uint64_t chooseUnimportant() override;
   inline void beginScope() override {}
   inline void endScope() override {}
+  inline bool plan(std::vector<uint64_t> &Prefix) override;
+  inline void replay(uint64_t Choices, const std::vector<double> &Weights,
+                     uint64_t Choice) override;
+  inline void abandon() override { this->Abandoned = true; }
+  inline bool canChoose(uint64_t Choices,
+                        const std::vector<double> &Weights) override;
 };
 
 std::unique_ptr<Chooser> WeightedSamplerGuide::makeChooser() {
-  return std::make_unique<WeightedSamplerChooser>(*this);
+  // our own chooser's shared hold on the tree would either be taken
+  // twice, or keep eviction waiting forever
+  assert(!ThreadClaim::held(this));
+  std::lock_guard<std::mutex> Guard(this->Gate);
+  if (this->liveNodes() > this->MaxNodes) {
+    std::unique_lock<std::shared_mutex> Exclusive(this->TreeLock);
+    this->evict();
+  }
+  ++this->Clock;
+  return std::make_unique<WeightedSamplerChooser>(*this,
+                                                  this->Seed + NumChoosers++);
 }
 
 uint64_t
@@ -691,15 +2451,71 @@ WeightedSamplerChooser::chooseWeighted(const std::vector<uint64_t> &Probs) {
 }
 
 uint64_t WeightedSamplerChooser::chooseUnimportant() {
-  return fullRange(*this->G.Rand);
+  return fullRange(this->Rand);
+}
+
+/*
+ * walk down the known part of the tree, deciding just as choose()
+ * would, until we explore a new child or reach a node that we don't
+ * know yet; everything below there is new, so random choices are what
+ * choose() would make anyway
+ */
+bool WeightedSamplerChooser::plan(std::vector<uint64_t> &Prefix) {
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  Prefix.clear();
+  uint32_t Index = this->Trail.back();
+  while (true) {
+    auto &N = this->G.Nodes.at(Index);
+    if (N.State != WeightedSamplerGuide::Visited || N.Collapsed ||
+        N.BranchFactor == 0)
+      return true;
+    if (this->shouldExplore(N)) {
+      Prefix.push_back(this->G.pickUnexplored(N, this->Rand));
+      return true;
+    }
+    uint64_t Choice;
+    std::tie(Choice, Index) = this->G.sampleChild(N, unif(this->Rand));
+    Prefix.push_back(Choice);
+  }
+}
+
+/*
+ * the node is set up here, rather than waiting for the choice itself,
+ * so that another chooser can't set it up differently in between
+ */
+bool WeightedSamplerChooser::canChoose(uint64_t Choices,
+                                       const std::vector<double> &Weights) {
+  if (this->OffTree)
+    return true;
+  return this->G.visit(this->G.Nodes.at(this->Trail.back()), Choices,
+                       Weights);
+}
+
+void WeightedSamplerChooser::replay(uint64_t Choices,
+                                    const std::vector<double> &Weights,
+                                    uint64_t Choice) {
+  if (this->OffTree)
+    return;
+  auto &current = this->G.Nodes.at(this->Trail.back());
+  if (!this->G.visit(current, Choices, Weights))
+    this->differentChoices();
+  if (current.Collapsed) {
+    this->OffTree = true;
+    return;
+  }
+  auto next_node = this->G.child(current, Choice);
+  if (next_node == WeightedSamplerGuide::None)
+    next_node = this->G.addChild(current, Choice);
+  this->enter(next_node);
+  this->Path.push_back(Choice);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
  * SaverGuide: wraps another guide in order to remember choices that
- * it made; use the chooser's getChoices() or formatChoices() methods
- * to retreive them
+ * it made; use the chooser's unpackChoices(), formatChoices(), or
+ * encodeChoices() methods to retreive them
  */
 
 static const std::string StartMarker{"BEGIN FORMATTED CHOICES"};
@@ -712,6 +2528,42 @@ struct rec {
   uint64_t v;
 };
 
+/*
+ * a recorded choice sequence in about half the space of recs: the
+ * values of the choices, in order, and separately the scope
+ * boundaries, each stored as the number of choices made before it,
+ * shifted left by one, with the low bit set for an END. this works
+ * because choices vastly outnumber scopes
+ */
+struct PackedChoices {
+  std::vector<uint64_t> Values;
+  std::vector<uint64_t> Scopes;
+
+  inline void clear() {
+    Values.clear();
+    Scopes.clear();
+  }
+  // call Fn on each rec, in order
+  template <typename Fn> inline void forEach(Fn &&fn) const;
+  inline void unpack(std::vector<rec> &Out) const {
+    Out.clear();
+    Out.reserve(Values.size() + Scopes.size());
+    forEach([&](const rec &R) { Out.push_back(R); });
+  }
+};
+
+template <typename Fn> void PackedChoices::forEach(Fn &&fn) const {
+  size_t NextScope = 0;
+  for (size_t i = 0; i <= Values.size(); ++i) {
+    while (NextScope < Scopes.size() && (Scopes[NextScope] >> 1) == i) {
+      fn(rec{(Scopes[NextScope] & 1) ? RecKind::END : RecKind::START, 0});
+      ++NextScope;
+    }
+    if (i < Values.size())
+      fn(rec{RecKind::NUM, Values[i]});
+  }
+}
+
 class SaverChooser;
 
 class SaverGuide : public Guide {
@@ -719,6 +2571,12 @@ class SaverGuide : public Guide {
   Guide *SubG;
   std::string Prefix;
   const size_t MAX_LINE_LENGTH = 70;
+  // buffers from finished choosers, kept for their capacity
+  std::mutex PoolLock;
+  std::vector<std::unique_ptr<PackedChoices>> Pool;
+
+  inline std::unique_ptr<PackedChoices> takeBuffer();
+  inline void giveBack(std::unique_ptr<PackedChoices> B);
 
 public:
   inline SaverGuide(uint64_t Seed) = delete;
@@ -735,97 +2593,244 @@ public:
 class SaverChooser : public Chooser {
   SaverGuide &G;
   std::unique_ptr<Chooser> C;
-  std::vector<rec> Saved;
+  std::unique_ptr<PackedChoices> Saved;
+  // what unpackChoices() returns; its storage is reused each time
+  std::vector<rec> Unpacked;
 
 public:
-  inline SaverChooser(SaverGuide &_G) : G(_G) { C = G.SubG->makeChooser(); }
-  inline ~SaverChooser() {}
+  inline SaverChooser(SaverGuide &_G) : G(_G), Saved(_G.takeBuffer()) {
+    C = G.SubG->makeChooser();
+  }
+  inline ~SaverChooser() { G.giveBack(std::move(Saved)); }
   inline uint64_t choose(uint64_t Choices) override;
   inline bool flip() override { return choose(2); }
   inline uint64_t chooseWeighted(const std::vector<double> &) override;
   inline uint64_t chooseWeighted(const std::vector<uint64_t> &) override;
   inline uint64_t chooseUnimportant() override;
   inline const std::string formatChoices();
-  inline std::vector<rec> &getChoices() { return Saved; }
+  inline const std::string encodeChoices();
+  inline const std::vector<rec> &unpackChoices() {
+    Saved->unpack(Unpacked);
+    return Unpacked;
+  }
+  inline const PackedChoices &getPackedChoices() { return *Saved; }
   inline void beginScope() override;
   inline void endScope() override;
+  inline void abandon() override { C->abandon(); }
+  inline bool canChoose(uint64_t Choices,
+                        const std::vector<double> &Weights) override {
+    return C->canChoose(Choices, Weights);
+  }
 };
 
 std::unique_ptr<Chooser> SaverGuide::makeChooser() {
   return std::make_unique<SaverChooser>(*this);
 }
 
+std::unique_ptr<PackedChoices> SaverGuide::takeBuffer() {
+  std::lock_guard<std::mutex> Guard(PoolLock);
+  if (Pool.empty())
+    return std::make_unique<PackedChoices>();
+  auto B = std::move(Pool.back());
+  Pool.pop_back();
+  return B;
+}
+
+void SaverGuide::giveBack(std::unique_ptr<PackedChoices> B) {
+  B->clear();
+  std::lock_guard<std::mutex> Guard(PoolLock);
+  Pool.push_back(std::move(B));
+}
+
 uint64_t SaverChooser::choose(uint64_t Choices) {
   auto X = C->choose(Choices);
-  rec r{tree_guide::RecKind::NUM, X};
-  Saved.push_back(r);
+  Saved->Values.push_back(X);
   return X;
 }
 
 uint64_t SaverChooser::chooseWeighted(const std::vector<double> &Probs) {
   auto X = C->chooseWeighted(Probs);
-  rec r{tree_guide::RecKind::NUM, X};
-  Saved.push_back(r);
+  Saved->Values.push_back(X);
   return X;
 }
 
 uint64_t SaverChooser::chooseWeighted(const std::vector<uint64_t> &Probs) {
   auto X = C->chooseWeighted(Probs);
-  rec r{tree_guide::RecKind::NUM, X};
-  Saved.push_back(r);
+  Saved->Values.push_back(X);
   return X;
 }
 
 uint64_t SaverChooser::chooseUnimportant() {
   auto X = C->chooseUnimportant();
-  rec r{tree_guide::RecKind::NUM, X};
-  Saved.push_back(r);
+  Saved->Values.push_back(X);
   return X;
 }
 
 void SaverChooser::beginScope() {
-  rec r{tree_guide::RecKind::START, 0};
-  Saved.push_back(r);
+  Saved->Scopes.push_back(Saved->Values.size() << 1);
   C->beginScope();
 }
 
 void SaverChooser::endScope() {
-  rec r{tree_guide::RecKind::END, 0};
-  Saved.push_back(r);
+  Saved->Scopes.push_back((Saved->Values.size() << 1) | 1);
   C->endScope();
 }
 
 const std::string SaverChooser::formatChoices() {
+  auto &Values = Saved->Values;
   std::string s;
-  s += G.Prefix + StartMarker + "\n";
-  std::vector<rec>::size_type pos = 0;
-  std::string line = G.Prefix;
-  while (pos < Saved.size()) {
-    std::string item;
-    switch (Saved.at(pos).k) {
+  // a guess that is usually close: most choices are small numbers
+  s.reserve(4 * (Values.size() + Saved->Scopes.size()) + 4 * G.Prefix.size() +
+            StartMarker.size() + EndMarker.size());
+  s += G.Prefix;
+  s += StartMarker;
+  s += '\n';
+  s += G.Prefix;
+  size_t LineLen = G.Prefix.size();
+  // room for the longest uint64_t and its comma
+  char Item[24];
+  Saved->forEach([&](const rec &r) {
+    char *ItemEnd;
+    switch (r.k) {
     case tree_guide::RecKind::START:
-      item = "{";
+      Item[0] = '{';
+      ItemEnd = Item + 1;
       break;
     case tree_guide::RecKind::END:
-      item = "}";
+      Item[0] = '}';
+      ItemEnd = Item + 1;
       break;
     case tree_guide::RecKind::NUM:
-      item = std::to_string(Saved.at(pos).v);
+      ItemEnd = std::to_chars(Item, Item + sizeof(Item) - 1, r.v).ptr;
       break;
     default:
       assert(false);
+      return;
     }
-    item += ",";
-    if (line.length() + item.length() >= G.MAX_LINE_LENGTH) {
-      s += line + "\n";
-      line = G.Prefix + item;
-    } else {
-      line += item;
+    *ItemEnd++ = ',';
+    size_t Len = ItemEnd - Item;
+    if (LineLen + Len >= G.MAX_LINE_LENGTH) {
+      s += '\n';
+      s += G.Prefix;
+      LineLen = G.Prefix.size();
+    }
+    s.append(Item, Len);
+    LineLen += Len;
+  });
+  s += '\n';
+  s += G.Prefix;
+  s += EndMarker;
+  s += '\n';
+  return s;
+}
+
+/*
+ * binary choice format: a compact alternative to the text format, for
+ * files that hold nothing but choices. it is BinaryChoiceMagic and a
+ * version, followed by one LEB128 varint per rec: 0 for START, 1 for
+ * END, and the value plus two for NUM. since a value plus two can need
+ * 65 bits, the tenth byte of a varint carries bits 63 and 64
+ */
+
+static const std::string BinaryChoiceMagic{"TGCHOICE"};
+static const uint64_t BinaryChoiceVersion = 1;
+
+// Carry is bit 64 of the number being written
+inline void putVarint(std::string &Out, uint64_t X, bool Carry = false) {
+  for (int i = 0; i < 9 && (X >= 0x80 || Carry); ++i) {
+    Out.push_back((char)(0x80 | (X & 0x7f)));
+    X >>= 7;
+  }
+  Out.push_back((char)(X | ((uint64_t)Carry << 1)));
+}
+
+inline bool getVarint(const char *&P, const char *End, uint64_t &X,
+                      bool &Carry) {
+  X = 0;
+  Carry = false;
+  for (int i = 0; i < 10 && P < End; ++i) {
+    uint8_t B = *P++;
+    if (i == 9) {
+      if (B > 3)
+        return false;
+      X |= (uint64_t)(B & 1) << 63;
+      Carry = B & 2;
+      return true;
+    }
+    X |= (uint64_t)(B & 0x7f) << (7 * i);
+    if (!(B & 0x80))
+      return true;
+  }
+  return false;
+}
+
+inline bool isBinaryChoices(const char *Buf, size_t Len) {
+  return Len >= BinaryChoiceMagic.size() &&
+         BinaryChoiceMagic.compare(0, BinaryChoiceMagic.size(), Buf,
+                                   BinaryChoiceMagic.size()) == 0;
+}
+
+inline void encodeRec(std::string &Out, const rec &R) {
+  switch (R.k) {
+  case RecKind::START:
+    putVarint(Out, 0);
+    break;
+  case RecKind::END:
+    putVarint(Out, 1);
+    break;
+  case RecKind::NUM:
+    putVarint(Out, R.v + 2, R.v + 2 < R.v);
+    break;
+  default:
+    assert(false);
+  }
+}
+
+inline void encodeChoices(const std::vector<rec> &Recs, std::string &Out) {
+  Out += BinaryChoiceMagic;
+  putVarint(Out, BinaryChoiceVersion);
+  for (auto &R : Recs)
+    encodeRec(Out, R);
+}
+
+/*
+ * append the recs in a binary choice sequence to Recs; on failure,
+ * print a message to Err and return false
+ */
+inline bool decodeChoices(const char *Buf, size_t Len, std::vector<rec> &Recs,
+                          std::ostream &Err = std::cerr) {
+  auto *End = Buf + Len;
+  uint64_t X;
+  bool Carry;
+  if (!isBinaryChoices(Buf, Len)) {
+    Err << "FATAL ERROR: Binary choices don't start with the magic "
+           "number\n\n";
+    return false;
+  }
+  Buf += BinaryChoiceMagic.size();
+  if (!getVarint(Buf, End, X, Carry) || Carry || X != BinaryChoiceVersion) {
+    Err << "FATAL ERROR: Unsupported binary choice version\n\n";
+    return false;
+  }
+  while (Buf < End) {
+    if (!getVarint(Buf, End, X, Carry)) {
+      Err << "FATAL ERROR: Truncated or corrupt binary choices\n\n";
+      return false;
     }
-    ++pos;
+    if (!Carry && X == 0)
+      Recs.push_back({RecKind::START, 0});
+    else if (!Carry && X == 1)
+      Recs.push_back({RecKind::END, 0});
+    else
+      Recs.push_back({RecKind::NUM, X - 2});
   }
-  s += line + "\n";
-  s += G.Prefix + EndMarker + "\n";
+  return true;
+}
+
+const std::string SaverChooser::encodeChoices() {
+  std::string s = BinaryChoiceMagic;
+  putVarint(s, BinaryChoiceVersion);
+  Saved->forEach([&](const rec &R) { encodeRec(s, R); });
   return s;
 }
 
@@ -837,45 +2842,271 @@ const std::string SaverChooser::formatChoices() {
  * file. this guide tries to reject syntactically invalid saved
  * choices, but also it tries to accept and deal with running out of
  * choices (it starts returning arbitrary values) and also
- * out-of-range choices (it reduces them to be in range)
+ * out-of-range choices (it reduces them to be in range). the choices
+ * can be in the text format, between markers anywhere in the file, or
+ * in the binary format, which is recognized by its magic number
  */
 
 enum class Sync { NONE = 888, RESYNC, BALANCE };
 
 class FileChooser;
+class ChoiceStream;
 
 class FileGuide : public Guide {
   friend FileChooser;
+  friend ChoiceStream;
   std::vector<rec> Choices;
   std::unique_ptr<std::mt19937_64> Rand;
   Sync S = Sync::BALANCE;
+  // set in streaming mode, in which Choices goes unused
+  std::unique_ptr<ChoiceStream> Stream;
+  bool Streamed = false;
+
+  enum class Line { SKIP, DONE, BAD };
+  static inline Line parseLine(std::string_view L, const std::string &Prefix,
+                               bool &InData, std::vector<rec> &Out,
+                               std::ostream &Err);
+  // when set, a file that doesn't parse is only reported by the
+  // return value, for callers that expect some of them not to
+  bool Quiet = false;
+  inline std::ostream &errors();
 
 public:
   inline FileGuide(uint64_t Seed) {
     Rand = std::make_unique<std::mt19937_64>(Seed);
   }
   inline FileGuide() : FileGuide(std::random_device{}()) {}
-  inline ~FileGuide() {}
+  inline ~FileGuide();
   inline std::unique_ptr<Chooser> makeChooser() override;
   inline void setSync(Sync _S) { S = _S; }
+  inline void setQuiet(bool _Quiet) { Quiet = _Quiet; }
   inline const std::string name() override { return "file"; }
   inline bool parseChoices(std::istream &file, const std::string &Prefix);
   inline bool parseChoices(std::string &fileName, const std::string &Prefix);
+  inline bool parseChoices(const char *Buf, size_t Len,
+                           const std::string &Prefix);
+  /*
+   * streaming mode: instead of parsing the whole file up front, decode
+   * each choice when the chooser gets to it, so that generation starts
+   * at once and runs in constant memory. regular files are mapped, and
+   * anything else, such as a pipe, is read a block at a time. since
+   * the file is only read once, only one chooser can be made
+   */
+  inline bool streamChoices(const std::string &FileName,
+                            const std::string &Prefix);
   inline std::vector<rec> &getChoices() { return Choices; }
   inline void replaceChoices(const std::vector<rec> &C);
 };
 
-class FileChooser : public Chooser {
-  FileGuide &G;
-  std::vector<rec>::size_type Pos = 0;
-  inline uint64_t nextVal();
-  long FileDepth = 0, GeneratorDepth = 0;
+/*
+ * decodes a choice file, in either format, a little at a time
+ */
+class ChoiceStream {
+  int FD;
+  // the part of the file we have in memory, which is all of it if the
+  // file is mapped
+  const char *P = nullptr, *End = nullptr;
+  char *Map = nullptr;
+  size_t MapLen = 0;
+  std::vector<char> Block;
+  // bytes we looked at to tell which format this is
+  std::string Head;
+  size_t HeadPos = 0;
+  const std::string Prefix;
+  bool Binary = false, InData = false, Done = false;
+  // text mode decodes a line at a time
+  std::string Line;
+  std::vector<rec> Window;
+  size_t WindowPos = 0;
+
+  inline bool getByte(char &C);
+  inline bool refill();
+  [[noreturn]] inline void corrupt();
 
 public:
-  inline FileChooser(FileGuide &_G) : G(_G) {}
-  inline ~FileChooser();
-  inline uint64_t choose(uint64_t Choices) override;
-  inline bool flip() override { return choose(2); }
+  inline ChoiceStream(int _FD, const std::string &_Prefix);
+  ChoiceStream(const ChoiceStream &) = delete;
+  ChoiceStream &operator=(const ChoiceStream &) = delete;
+  inline ~ChoiceStream();
+  inline bool start();
+  // the next rec, if there is one, without moving past it
+  inline bool peek(rec &R);
+  inline void next() { ++WindowPos; }
+};
+
+ChoiceStream::ChoiceStream(int _FD, const std::string &_Prefix)
+    : FD(_FD), Prefix(_Prefix) {
+  struct stat St;
+  if (fstat(FD, &St) == 0 && S_ISREG(St.st_mode) && St.st_size > 0) {
+    auto *M = mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+    if (M != MAP_FAILED) {
+      Map = (char *)M;
+      MapLen = St.st_size;
+      madvise(Map, MapLen, MADV_SEQUENTIAL);
+      P = Map;
+      End = Map + MapLen;
+      return;
+    }
+  }
+  Block.resize(1 << 16);
+}
+
+ChoiceStream::~ChoiceStream() {
+  if (Map)
+    munmap(Map, MapLen);
+  close(FD);
+}
+
+bool ChoiceStream::refill() {
+  if (Map)
+    return false;
+  ssize_t N;
+  do {
+    N = read(FD, Block.data(), Block.size());
+  } while (N < 0 && errno == EINTR);
+  if (N <= 0)
+    return false;
+  P = Block.data();
+  End = P + N;
+  return true;
+}
+
+bool ChoiceStream::getByte(char &C) {
+  if (HeadPos < Head.size()) {
+    C = Head[HeadPos++];
+    return true;
+  }
+  if (P == End && !refill())
+    return false;
+  C = *P++;
+  return true;
+}
+
+void ChoiceStream::corrupt() {
+  std::cerr << "FATAL ERROR: Truncated or corrupt binary choices\n\n";
+  exit(-1);
+}
+
+/*
+ * find out which format the file is in, and get ready to decode the
+ * first choice; on failure, print a message and return false
+ */
+bool ChoiceStream::start() {
+  char C;
+  while (Head.size() < BinaryChoiceMagic.size() && getByte(C)) {
+    Head.push_back(C);
+    HeadPos = Head.size();
+  }
+  // text is decoded from the beginning
+  HeadPos = 0;
+  if (isBinaryChoices(Head.data(), Head.size())) {
+    Binary = true;
+    HeadPos = Head.size();
+    // the version is at most two bytes, so it fits in a window
+    std::string V;
+    while (V.size() < 2 && (V.empty() || (V.back() & 0x80)) && getByte(C))
+      V.push_back(C);
+    const char *VP = V.data();
+    uint64_t X;
+    bool Carry;
+    if (!getVarint(VP, V.data() + V.size(), X, Carry) || Carry ||
+        X != BinaryChoiceVersion) {
+      std::cerr << "FATAL ERROR: Unsupported binary choice version\n\n";
+      return false;
+    }
+  }
+  rec R;
+  if (!peek(R)) {
+    std::cerr << "FATAL ERROR: No choices could be parsed\n\n";
+    return false;
+  }
+  return true;
+}
+
+bool ChoiceStream::peek(rec &R) {
+  while (WindowPos == Window.size()) {
+    if (Done)
+      return false;
+    Window.clear();
+    WindowPos = 0;
+    char C;
+    if (Binary) {
+      // decode one varint into the window
+      char Bytes[10];
+      int N = 0;
+      if (!getByte(C)) {
+        Done = true;
+        return false;
+      }
+      Bytes[N++] = C;
+      while ((C & 0x80) && N < 10) {
+        if (!getByte(C))
+          corrupt();
+        Bytes[N++] = C;
+      }
+      const char *BP = Bytes;
+      uint64_t X;
+      bool Carry;
+      if (!getVarint(BP, Bytes + N, X, Carry))
+        corrupt();
+      if (!Carry && X == 0)
+        Window.push_back({RecKind::START, 0});
+      else if (!Carry && X == 1)
+        Window.push_back({RecKind::END, 0});
+      else
+        Window.push_back({RecKind::NUM, X - 2});
+      continue;
+    }
+    Line.clear();
+    bool Any = false;
+    while (getByte(C)) {
+      Any = true;
+      if (C == '\n')
+        break;
+      Line.push_back(C);
+    }
+    if (!Any) {
+      Done = true;
+      return false;
+    }
+    auto Res = FileGuide::parseLine(Line, Prefix, InData, Window, std::cerr);
+    if (Res == FileGuide::Line::BAD)
+      exit(-1);
+    if (Res == FileGuide::Line::DONE)
+      Done = true;
+  }
+  R = Window[WindowPos];
+  return true;
+}
+
+FileGuide::~FileGuide() {}
+
+bool FileGuide::streamChoices(const std::string &FileName,
+                              const std::string &Prefix) {
+  int FD = open(FileName.c_str(), O_RDONLY | O_CLOEXEC);
+  if (FD < 0) {
+    std::cerr << "FATAL ERROR: Cannot open choice file '" << FileName
+              << "'\n\n";
+    return false;
+  }
+  Stream = std::make_unique<ChoiceStream>(FD, Prefix);
+  Streamed = false;
+  return Stream->start();
+}
+
+class FileChooser : public Chooser {
+  FileGuide &G;
+  std::vector<rec>::size_type Pos = 0;
+  inline bool peekRec(rec &R);
+  inline void nextRec();
+  inline uint64_t nextVal();
+  long FileDepth = 0, GeneratorDepth = 0;
+
+public:
+  inline FileChooser(FileGuide &_G) : G(_G) {}
+  inline ~FileChooser();
+  inline uint64_t choose(uint64_t Choices) override;
+  inline bool flip() override { return choose(2); }
   inline uint64_t chooseWeighted(const std::vector<double> &) override;
   inline uint64_t chooseWeighted(const std::vector<uint64_t> &) override;
   inline uint64_t chooseUnimportant() override;
@@ -891,87 +3122,154 @@ public:
 };
 
 std::unique_ptr<Chooser> FileGuide::makeChooser() {
+  if (Stream) {
+    if (Streamed) {
+      std::cerr << "FATAL ERROR: A streaming file guide can only make one "
+                   "chooser\n\n";
+      exit(-1);
+    }
+    Streamed = true;
+  }
   return std::make_unique<FileChooser>(*this);
 }
 
 void FileGuide::replaceChoices(const std::vector<rec> &C) {
+  Stream.reset();
   Choices.clear();
   for (auto x : C)
     Choices.push_back(x);
 }
 
+// where parse errors go, which is nowhere when we're quiet
+std::ostream &FileGuide::errors() {
+  // an ostream without a buffer writes nothing
+  static thread_local std::ostream Discard(nullptr);
+  return Quiet ? Discard : std::cerr;
+}
+
+/*
+ * handle one line of a choice file; InData says whether we're between
+ * the start and end markers; errors are reported to Err
+ */
+FileGuide::Line FileGuide::parseLine(std::string_view L,
+                                     const std::string &Prefix, bool &InData,
+                                     std::vector<rec> &Out, std::ostream &Err) {
+  auto PrefixLen = Prefix.size();
+  if (!InData) {
+    if (L.find(Prefix + StartMarker) != std::string_view::npos)
+      InData = true;
+    return Line::SKIP;
+  }
+  if (L.size() == PrefixLen + EndMarker.size() &&
+      L.compare(0, PrefixLen, Prefix) == 0 &&
+      L.compare(PrefixLen, std::string_view::npos, EndMarker) == 0)
+    return Line::DONE;
+  if (L.compare(0, PrefixLen, Prefix) != 0) {
+    Err << "FATAL ERROR: Expected every line of choices to start with '"
+        << Prefix << "'\n\n";
+    return Line::BAD;
+  }
+  auto illegal = [&](char c) {
+    Err << "FATAL ERROR: Illegal character '" << c << "' in choice string\n\n";
+    Err << "line: '" << L << "'\n";
+    return Line::BAD;
+  };
+  const char *P = L.data() + PrefixLen, *E = L.data() + L.size();
+  while (P < E) {
+    rec r{tree_guide::RecKind::NUM, 0};
+    if (*P == '{' || *P == '}') {
+      r.k = *P == '{' ? tree_guide::RecKind::START : tree_guide::RecKind::END;
+      ++P;
+    } else {
+      auto Res = std::from_chars(P, E, r.v);
+      if (Res.ec == std::errc::result_out_of_range) {
+        Err << "FATAL ERROR: Choice out of range in choice string\n\n";
+        Err << "line: '" << L << "'\n";
+        return Line::BAD;
+      }
+      if (Res.ec != std::errc())
+        return illegal(*P);
+      P = Res.ptr;
+    }
+    // an item without its comma at the end of a line doesn't count
+    if (P == E)
+      break;
+    if (*P != ',')
+      return illegal(*P);
+    ++P;
+    Out.push_back(r);
+  }
+  return Line::SKIP;
+}
+
 bool FileGuide::parseChoices(std::istream &file, const std::string &Prefix) {
   std::string line;
-  bool inData = false;
-  auto PrefixLen = Prefix.size();
+  bool inData = false, first = true;
   while (std::getline(file, line)) {
-    if (inData) {
-      if (line == (Prefix + EndMarker)) {
-        break;
-      } else {
-        if (line.compare(0, PrefixLen, Prefix) != 0) {
-          std::cerr << "FATAL ERROR: Expected every line of choices to start "
-                       "with '"
-                    << Prefix << "'\n\n";
-          return false;
-        }
-        uint64_t val = 0;
-        RecKind k = tree_guide::RecKind::NONE;
-        for (std::string::size_type pos = PrefixLen; pos < line.length();
-             ++pos) {
-          auto c = line[pos];
-          if (c == ',') {
-            rec r;
-            switch (k) {
-            case tree_guide::RecKind::NUM:
-              r.v = val;
-              val = 0;
-              break;
-            case tree_guide::RecKind::START:
-              break;
-            case tree_guide::RecKind::END:
-              break;
-            default:
-              assert(false);
-            }
-            r.k = k;
-            Choices.push_back(r);
-            k = tree_guide::RecKind::NONE;
-          } else if (c >= '0' && c <= '9') {
-            // TODO check for integer overflow here, that could happen
-            // if a choice sequence file got corrupted
-            val *= 10;
-            val += c - '0';
-            k = tree_guide::RecKind::NUM;
-          } else if (c == '{') {
-            k = tree_guide::RecKind::START;
-          } else if (c == '}') {
-            k = tree_guide::RecKind::END;
-          } else {
-            std::cerr << "FATAL ERROR: Illegal character '" << c
-                      << "' in choice string\n\n";
-            std::cerr << "line: '" << line << "'\n";
-            return false;
-          }
-        }
-      }
-    } else {
-      if (line.find(Prefix + StartMarker) != std::string::npos)
-        inData = true;
+    if (first && isBinaryChoices(line.data(), line.size())) {
+      // put back the newline that getline() ate, and take the rest
+      if (!file.eof())
+        line += '\n';
+      line.append(std::istreambuf_iterator<char>(file),
+                  std::istreambuf_iterator<char>());
+      return parseChoices(line.data(), line.size(), Prefix);
     }
+    first = false;
+    auto Res = parseLine(line, Prefix, inData, Choices, errors());
+    if (Res == Line::BAD)
+      return false;
+    if (Res == Line::DONE)
+      break;
   }
   if (Choices.size() == 0) {
-    std::cerr << "FATAL ERROR: No choices could be parsed\n\n";
+    errors() << "FATAL ERROR: No choices could be parsed\n\n";
+    return false;
+  }
+  return true;
+}
+
+/*
+ * parse choices straight out of memory, for callers that already have
+ * the file's contents
+ */
+bool FileGuide::parseChoices(const char *Buf, size_t Len,
+                             const std::string &Prefix) {
+  if (isBinaryChoices(Buf, Len)) {
+    if (!decodeChoices(Buf, Len, Choices, errors()))
+      return false;
+    if (Choices.size() == 0) {
+      errors() << "FATAL ERROR: No choices could be parsed\n\n";
+      return false;
+    }
+    return true;
+  }
+  // most items are small numbers, so this is usually close
+  Choices.reserve(Choices.size() + Len / 4);
+  bool inData = false;
+  auto *End = Buf + Len;
+  while (Buf < End) {
+    auto *NL = (const char *)memchr(Buf, '\n', End - Buf);
+    auto *LineEnd = NL ? NL : End;
+    auto Res = parseLine(std::string_view(Buf, LineEnd - Buf), Prefix, inData,
+                         Choices, errors());
+    if (Res == Line::BAD)
+      return false;
+    if (Res == Line::DONE)
+      break;
+    Buf = NL ? NL + 1 : End;
+  }
+  if (Choices.size() == 0) {
+    errors() << "FATAL ERROR: No choices could be parsed\n\n";
     return false;
   }
   return true;
 }
 
 bool FileGuide::parseChoices(std::string &FileName, const std::string &Prefix) {
-  std::ifstream file(FileName);
+  std::ifstream file(FileName, std::ios::binary);
   if (!file.is_open()) {
-    std::cerr << "FATAL ERROR: Cannot open choice file '" << FileName
-              << "'\n\n";
+    errors() << "FATAL ERROR: Cannot open choice file '" << FileName
+             << "'\n\n";
     return false;
   }
   auto res = parseChoices(file, Prefix);
@@ -1001,7 +3299,8 @@ FileChooser::~FileChooser() {
     }
     // often there's (at least) an end scope still sitting there, we
     // need to process it
-    while (Pos < G.Choices.size())
+    rec r;
+    while (peekRec(r))
       nextVal();
     if (FileDepth != 0) {
       std::cerr << "FATAL ERROR: Unbalanced scopes from file with depth "
@@ -1011,25 +3310,40 @@ FileChooser::~FileChooser() {
   }
 }
 
+bool FileChooser::peekRec(rec &R) {
+  if (G.Stream)
+    return G.Stream->peek(R);
+  if (Pos >= G.Choices.size())
+    return false;
+  R = G.Choices[Pos];
+  return true;
+}
+
+void FileChooser::nextRec() {
+  if (G.Stream)
+    G.Stream->next();
+  else
+    ++Pos;
+}
+
 uint64_t FileChooser::nextVal() {
 again:
 
   // if we've exhausted the choice sequence from disk, we have no
   // choice besides returning randomness
-  if (Pos >= G.Choices.size()) {
+  rec r;
+  if (!peekRec(r)) {
     if (Verbose)
       std::cerr << "Choice sequence exhausted, returning randomness\n";
     return fullRange(*G.Rand.get());
   }
 
-  auto r = G.Choices.at(Pos);
-
   // next we give the file guide a chance to catch up with the scoping
   // level of the generator
 
   if (r.k == tree_guide::RecKind::START) {
     ++FileDepth;
-    ++Pos;
+    nextRec();
     if (Verbose)
       std::cerr << "START: FileDepth is now " << FileDepth << "\n";
     goto again;
@@ -1043,7 +3357,7 @@ again:
       std::cerr << "FATAL ERROR: Negative nesting depth from file side\n\n";
       exit(-1);
     }
-    ++Pos;
+    nextRec();
     goto again;
   }
 
@@ -1055,7 +3369,7 @@ again:
 
   // already lined up -- no problem
   if (G.S != Sync::RESYNC || FileDepth == GeneratorDepth) {
-    ++Pos;
+    nextRec();
     if (Verbose)
       std::cerr << "Returning number: " << r.v << "\n";
     return r.v;
@@ -1073,7 +3387,7 @@ again:
   if (FileDepth > GeneratorDepth) {
     if (Verbose)
       std::cerr << "Discarding saved choice\n";
-    ++Pos;
+    nextRec();
     goto again;
   }
 
@@ -1143,6 +3457,11 @@ public:
   inline bool hasSubChooser() { return C != nullptr; }
   inline void beginScope() override { C->beginScope(); }
   inline void endScope() override { C->endScope(); }
+  inline void abandon() override { C->abandon(); }
+  inline bool canChoose(uint64_t Choices,
+                        const std::vector<double> &Weights) override {
+    return C->canChoose(Choices, Weights);
+  }
 };
 
 uint64_t RRChooser::choose(uint64_t Choices) { return C->choose(Choices); }
@@ -1167,13 +3486,1081 @@ std::unique_ptr<Chooser> RRGuide::makeChooser() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/*
+ * ShardedGuide: gives each worker thread a private replica of a
+ * WeightedSamplerGuide, so that choosers in different threads never
+ * touch the same tree. every SyncInterval samples, a worker merges
+ * what its replica has learned since the last sync into a shared
+ * consensus tree, and then merges back what the consensus has learned
+ * since then, picking up what the other workers have found in the
+ * meantime. both merges only walk the parts of the trees that changed,
+ * and only lock the two trees involved, so workers sync concurrently.
+ * as with the guides it wraps, a thread must not ask for a new chooser
+ * while it still holds one
+ */
+
+class ShardedGuide : public Guide {
+  struct Shard {
+    // protects Replica and the clocks below, for consensus()
+    std::mutex Lock;
+    std::unique_ptr<WeightedSamplerGuide> Replica;
+    // what merge() returned last time we merged in each direction
+    uint32_t Pushed = 0, Pulled = 0;
+    uint64_t Samples = 0;
+  };
+  const uint64_t Seed;
+  const uint64_t SyncInterval;
+  WeightedSamplerGuide Consensus;
+  // number of replicas made so far
+  std::atomic<uint64_t> Generation{0};
+  // indexed by workerIndex(); a shard is only used by its own worker,
+  // but the vector itself is protected by ShardsLock
+  std::mutex ShardsLock;
+  std::vector<std::unique_ptr<Shard>> Shards;
+
+  inline Shard &myShard();
+  inline void sync(Shard &S);
+
+public:
+  inline ShardedGuide(uint64_t _Seed, uint64_t _SyncInterval = 1000)
+      : Seed(_Seed), SyncInterval(_SyncInterval), Consensus(_Seed) {}
+  inline ShardedGuide() : ShardedGuide(0) {}
+  inline ~ShardedGuide() {}
+  inline std::unique_ptr<Chooser> makeChooser() override;
+  /*
+   * merge every replica into the consensus and return it; there must
+   * be no live choosers
+   */
+  inline WeightedSamplerGuide &consensus();
+  inline const std::string name() override {
+    return "sharded weighted sample";
+  }
+};
+
+ShardedGuide::Shard &ShardedGuide::myShard() {
+  auto Worker = workerIndex();
+  std::lock_guard<std::mutex> Guard(this->ShardsLock);
+  if (Worker >= this->Shards.size())
+    this->Shards.resize(Worker + 1);
+  if (!this->Shards.at(Worker))
+    this->Shards.at(Worker) = std::make_unique<Shard>();
+  return *this->Shards.at(Worker);
+}
+
+void ShardedGuide::sync(Shard &S) {
+  std::lock_guard<std::mutex> Guard(S.Lock);
+  if (S.Replica) {
+    S.Pushed = this->Consensus.merge(*S.Replica, S.Pushed);
+  } else {
+    // a replica's choosers are seeded consecutively from its own
+    // seed, so space the replicas' seeds out to keep those ranges
+    // disjoint
+    S.Replica = std::make_unique<WeightedSamplerGuide>(
+        this->Seed + (++this->Generation << 32));
+  }
+  S.Pulled = S.Replica->merge(this->Consensus, S.Pulled);
+  // what we just pulled in is already in the consensus
+  S.Pushed = S.Replica->clock();
+  S.Samples = 0;
+}
+
+std::unique_ptr<Chooser> ShardedGuide::makeChooser() {
+  auto &S = this->myShard();
+  if (!S.Replica || S.Samples >= this->SyncInterval)
+    this->sync(S);
+  ++S.Samples;
+  return S.Replica->makeChooser();
+}
+
+WeightedSamplerGuide &ShardedGuide::consensus() {
+  std::lock_guard<std::mutex> ShardsGuard(this->ShardsLock);
+  for (auto &S : this->Shards) {
+    if (!S)
+      continue;
+    std::lock_guard<std::mutex> Guard(S->Lock);
+    if (S->Replica)
+      S->Pushed = this->Consensus.merge(*S->Replica, S->Pushed);
+  }
+  return this->Consensus;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 /*
  * remote guide: ephemeral in-process guide that talks to a different
  * guide living in a server process; use this for generators that can
  * only traverse the decision tree once each time they run
+ *
+ * a GuideServer serves one guide to any number of clients, which may
+ * be on other hosts, over TCP ("host:port") or a unix-domain socket
+ * ("unix:/path"). each connection is handled by its own thread, so
+ * the served guide must allow choosers to be live in several threads
+ * at once, as BFSGuide, WeightedSamplerGuide and ShardedGuide do. a
+ * RemoteGuide is one connection to a server, and has at most one live
+ * chooser at a time; a multi-threaded client uses one per thread
+ *
+ * the protocol is a stream of one-byte opcodes, each followed by its
+ * arguments as little-endian 64-bit integers. it has two modes:
+ *
+ * - batched, the default: when a traversal starts, the server plans
+ *   its beginning, and sends the client that prefix of choices along
+ *   with a seed. the client makes the prefix choices and then random
+ *   ones by itself, and sends the log of all of them back as it goes,
+ *   for the server to replay into its chooser. this costs one round
+ *   trip per traversal, and needs a served guide whose choosers
+ *   support Chooser::plan(), as BFSGuide's and WeightedSamplerGuide's
+ *   do
+ *
+ * - interactive, used otherwise: every choice waits for an answer
+ *   from the server, which costs one round trip per choice
+ *
+ * requests that don't need an answer are buffered and go out along
+ * with the next one that does, except that the end of a traversal is
+ * sent straight away, since the served guide may be holding other
+ * clients back until it sees it. chooseUnimportant() never shapes the
+ * tree, so it is always answered locally
+ *
+ * every choice has at least one option, and a weighted choice at most
+ * MaxRemoteWeights of them. the server disconnects a client that sends
+ * anything else, rather than trust it with its memory
+ */
+
+enum class RemoteOp : uint8_t {
+  BEGIN = 'B',
+  CHOOSE = 'C',
+  WEIGHTED = 'W',
+  WEIGHTED_INT = 'I',
+  BEGIN_SCOPE = '(',
+  END_SCOPE = ')',
+  END = 'E',
+  BATCH = 'P',
+  REPLAY = 'R',
+  REPLAY_WEIGHTED = 'V',
+};
+
+// the server's answer to BATCH
+enum class RemoteBatch : uint8_t { NONE, READY, INTERACTIVE };
+
+static const uint64_t MaxRemoteWeights = (uint64_t)1 << 24;
+
+// clients check their own choices, so a bad one fails where it's made
+inline void remoteCheckChoices(uint64_t Choices, bool Weighted) {
+  if (Choices == 0 || (Weighted && Choices > MaxRemoteWeights)) {
+    std::cerr << "FATAL ERROR: Remote guide cannot make a"
+              << (Weighted ? " weighted" : "") << " choice among " << Choices
+              << " options\n\n";
+    exit(-1);
+  }
+}
+
+/*
+ * a buffered, bidirectional byte stream over a socket. output is only
+ * sent when we run out of input and have to wait for more, so requests
+ * that don't need an answer travel together with the next one that
+ * does
+ */
+class RemoteStream {
+  int FD;
+  std::string Out;
+  char In[4096];
+  size_t InPos = 0, InLen = 0;
+
+  inline bool fill() {
+    if (!flush())
+      return false;
+    ssize_t N;
+    do {
+      N = read(FD, In, sizeof(In));
+    } while (N < 0 && errno == EINTR);
+    if (N <= 0)
+      return false;
+    InPos = 0;
+    InLen = N;
+    return true;
+  }
+
+public:
+  inline RemoteStream(int _FD) : FD(_FD) {}
+  RemoteStream(const RemoteStream &) = delete;
+  RemoteStream &operator=(const RemoteStream &) = delete;
+  inline ~RemoteStream() {
+    flush();
+    close(FD);
+  }
+
+  inline void put8(uint8_t X) { Out.push_back(X); }
+
+  inline void put64(uint64_t X) {
+    for (int i = 0; i < 8; ++i)
+      Out.push_back((char)(X >> (8 * i)));
+  }
+
+  inline size_t pending() { return Out.size(); }
+
+  inline bool flush() {
+    size_t Sent = 0;
+    while (Sent < Out.size()) {
+      auto N = send(FD, Out.data() + Sent, Out.size() - Sent, MSG_NOSIGNAL);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0) {
+        Out.clear();
+        return false;
+      }
+      Sent += N;
+    }
+    Out.clear();
+    return true;
+  }
+
+  inline bool get8(uint8_t &X) {
+    if (InPos == InLen && !fill())
+      return false;
+    X = In[InPos++];
+    return true;
+  }
+
+  inline bool get64(uint64_t &X) {
+    X = 0;
+    for (int i = 0; i < 8; ++i) {
+      uint8_t B;
+      if (!get8(B))
+        return false;
+      X |= (uint64_t)B << (8 * i);
+    }
+    return true;
+  }
+};
+
+/*
+ * split "host:port" or "unix:/path" into a socket address; on failure,
+ * print a message and return false
+ */
+inline bool remoteAddress(const std::string &Address, bool Passive,
+                          struct addrinfo **Result,
+                          struct sockaddr_un &Unix) {
+  *Result = nullptr;
+  if (Address.compare(0, 5, "unix:") == 0) {
+    auto Path = Address.substr(5);
+    if (Path.empty() || Path.size() >= sizeof(Unix.sun_path)) {
+      std::cerr << "FATAL ERROR: Bad socket path in '" << Address << "'\n\n";
+      return false;
+    }
+    std::memset(&Unix, 0, sizeof(Unix));
+    Unix.sun_family = AF_UNIX;
+    std::strcpy(Unix.sun_path, Path.c_str());
+    return true;
+  }
+  auto Colon = Address.rfind(':');
+  if (Colon == std::string::npos) {
+    std::cerr << "FATAL ERROR: Expected 'host:port' or 'unix:/path', not '"
+              << Address << "'\n\n";
+    return false;
+  }
+  auto Host = Address.substr(0, Colon), Port = Address.substr(Colon + 1);
+  struct addrinfo Hints;
+  std::memset(&Hints, 0, sizeof(Hints));
+  Hints.ai_family = AF_UNSPEC;
+  Hints.ai_socktype = SOCK_STREAM;
+  Hints.ai_flags = Passive ? AI_PASSIVE : 0;
+  auto Err = getaddrinfo(Host.empty() ? nullptr : Host.c_str(), Port.c_str(),
+                         &Hints, Result);
+  if (Err != 0) {
+    std::cerr << "FATAL ERROR: Cannot resolve '" << Address
+              << "': " << gai_strerror(Err) << "\n\n";
+    return false;
+  }
+  return true;
+}
+
+/*
+ * choices are latency-bound, so don't let TCP hold small messages back
+ */
+inline void remoteNoDelay(int FD) {
+  int One = 1;
+  setsockopt(FD, IPPROTO_TCP, TCP_NODELAY, &One, sizeof(One));
+}
+
+class GuideServer {
+  Guide &G;
+  int ListenFD = -1;
+  // the socket file we created, if any
+  std::string UnixPath;
+  // set by stop(), which can be called from a signal handler
+  std::atomic<bool> Stopping{false};
+  static_assert(std::atomic<bool>::is_always_lock_free);
+  // the connections being served, so that serve() can hang up on them
+  // once it's stopped; sessions are detached, and serve() waits for
+  // this to empty
+  std::mutex SessionLock;
+  std::condition_variable SessionsDone;
+  std::vector<int> SessionFDs;
+
+  inline void session(int FD);
+
+public:
+  inline GuideServer(Guide &_G, const std::string &Address);
+  inline ~GuideServer() {
+    close(ListenFD);
+    if (!UnixPath.empty())
+      unlink(UnixPath.c_str());
+  }
+  /*
+   * accept clients until stop() is called, then stop reading from the
+   * connected ones once they've sent nothing more than what's already
+   * arrived, and wait for them to go away
+   */
+  inline void serve();
+  /*
+   * make serve() stop; this only sets a flag and shuts down a socket,
+   * so it's safe to call from a signal handler
+   */
+  inline void stop();
+};
+
+GuideServer::GuideServer(Guide &_G, const std::string &Address) : G(_G) {
+  struct addrinfo *AI;
+  struct sockaddr_un Unix;
+  if (!remoteAddress(Address, true, &AI, Unix))
+    exit(-1);
+  if (AI == nullptr) {
+    unlink(Unix.sun_path);
+    ListenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ListenFD >= 0 &&
+        bind(ListenFD, (struct sockaddr *)&Unix, sizeof(Unix)) != 0) {
+      close(ListenFD);
+      ListenFD = -1;
+    }
+    if (ListenFD >= 0)
+      UnixPath = Unix.sun_path;
+  } else {
+    for (auto *P = AI; P && ListenFD < 0; P = P->ai_next) {
+      ListenFD = socket(P->ai_family, P->ai_socktype, P->ai_protocol);
+      if (ListenFD < 0)
+        continue;
+      int One = 1;
+      setsockopt(ListenFD, SOL_SOCKET, SO_REUSEADDR, &One, sizeof(One));
+      if (bind(ListenFD, P->ai_addr, P->ai_addrlen) != 0) {
+        close(ListenFD);
+        ListenFD = -1;
+      }
+    }
+    freeaddrinfo(AI);
+  }
+  if (ListenFD < 0 || listen(ListenFD, 64) != 0) {
+    std::cerr << "FATAL ERROR: Cannot listen on '" << Address << "'\n\n";
+    exit(-1);
+  }
+}
+
+void GuideServer::serve() {
+  while (!Stopping) {
+    int FD = accept(ListenFD, nullptr, nullptr);
+    if (FD < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    if (Stopping) {
+      close(FD);
+      break;
+    }
+    remoteNoDelay(FD);
+    {
+      std::lock_guard<std::mutex> Guard(SessionLock);
+      SessionFDs.push_back(FD);
+    }
+    std::thread([this, FD]() { this->session(FD); }).detach();
+  }
+  std::unique_lock<std::mutex> Guard(SessionLock);
+  // a session's reads still return whatever its client already sent,
+  // and then the end of the stream, and its replies still go out
+  for (auto FD : SessionFDs)
+    shutdown(FD, SHUT_RD);
+  SessionsDone.wait(Guard, [&] { return SessionFDs.empty(); });
+}
+
+void GuideServer::stop() {
+  Stopping = true;
+  // wakes up the accept() in serve()
+  shutdown(ListenFD, SHUT_RDWR);
+}
+
+void GuideServer::session(int FD) {
+  RemoteStream S(FD);
+  // on the way out, after the chooser is done with the guide but
+  // before S closes the socket, which could then be reused
+  struct Leave {
+    GuideServer &Server;
+    int FD;
+    ~Leave() {
+      std::lock_guard<std::mutex> Guard(Server.SessionLock);
+      auto &FDs = Server.SessionFDs;
+      FDs.erase(std::find(FDs.begin(), FDs.end(), FD));
+      Server.SessionsDone.notify_all();
+    }
+  } LeaveGuard{*this, FD};
+  std::unique_ptr<Chooser> C;
+  std::mt19937_64 Rand(std::random_device{}());
+  std::vector<uint64_t> Prefix;
+  std::vector<double> Weights;
+  // a traversal that is still going when we leave, because the client
+  // went away or misbehaved, is thrown away rather than finished
+  struct Abandon {
+    std::unique_ptr<Chooser> &C;
+    ~Abandon() {
+      if (C)
+        C->abandon();
+    }
+  } AbandonGuard{C};
+  uint8_t Op;
+  uint64_t N, Choice;
+  // only a traversal that the chooser planned can be replayed to it,
+  // starting with the planned choices
+  bool Planned = false;
+  size_t Replayed = 0;
+  auto badChoices = [&](bool Weighted) {
+    if (N > 0 && (!Weighted || N <= MaxRemoteWeights))
+      return false;
+    std::cerr << "ERROR: Remote guide client asked for a choice among " << N
+              << " options, disconnecting it\n\n";
+    return true;
+  };
+  // a guide exits rather than build a tree that contradicts itself,
+  // so ask it first, and let only this client go
+  auto wrongShape = [&](const std::vector<double> &W) {
+    if (C->canChoose(N, W))
+      return false;
+    std::cerr << "ERROR: Remote guide client disagrees with the tree about "
+                 "how many options there are, disconnecting it\n\n";
+    return true;
+  };
+  while (S.get8(Op)) {
+    if (Op != (uint8_t)RemoteOp::BEGIN && Op != (uint8_t)RemoteOp::BATCH &&
+        Op != (uint8_t)RemoteOp::END && !C) {
+      std::cerr << "ERROR: Remote guide client sent a request outside of a "
+                   "traversal, disconnecting it\n\n";
+      break;
+    }
+    switch ((RemoteOp)Op) {
+    case RemoteOp::BEGIN:
+      if (C)
+        C->abandon();
+      C.reset();
+      C = G.makeChooser();
+      Planned = false;
+      S.put8(C != nullptr);
+      break;
+    case RemoteOp::CHOOSE:
+      Weights.clear();
+      if (!S.get64(N) || badChoices(false) || wrongShape(Weights))
+        return;
+      S.put64(C->choose(N));
+      break;
+    case RemoteOp::WEIGHTED: {
+      if (!S.get64(N) || badChoices(true))
+        return;
+      std::vector<double> Probs(N);
+      for (auto &P : Probs) {
+        uint64_t Bits;
+        if (!S.get64(Bits))
+          return;
+        std::memcpy(&P, &Bits, sizeof(P));
+      }
+      if (wrongShape(Probs))
+        return;
+      S.put64(C->chooseWeighted(Probs));
+      break;
+    }
+    case RemoteOp::WEIGHTED_INT: {
+      if (!S.get64(N) || badChoices(true))
+        return;
+      std::vector<uint64_t> Probs(N);
+      for (auto &P : Probs)
+        if (!S.get64(P))
+          return;
+      Weights.assign(Probs.begin(), Probs.end());
+      if (wrongShape(Weights))
+        return;
+      S.put64(C->chooseWeighted(Probs));
+      break;
+    }
+    case RemoteOp::BEGIN_SCOPE:
+      C->beginScope();
+      break;
+    case RemoteOp::END_SCOPE:
+      C->endScope();
+      break;
+    case RemoteOp::END:
+      Weights.clear();
+      N = 0;
+      if (C && wrongShape(Weights))
+        return;
+      C.reset();
+      break;
+    case RemoteOp::BATCH:
+      if (C)
+        C->abandon();
+      C.reset();
+      C = G.makeChooser();
+      Planned = C && C->plan(Prefix);
+      Replayed = 0;
+      if (!C) {
+        S.put8((uint8_t)RemoteBatch::NONE);
+      } else if (!Planned) {
+        S.put8((uint8_t)RemoteBatch::INTERACTIVE);
+      } else {
+        S.put8((uint8_t)RemoteBatch::READY);
+        S.put64(Rand());
+        S.put64(Prefix.size());
+        for (auto P : Prefix)
+          S.put64(P);
+      }
+      break;
+    case RemoteOp::REPLAY:
+    case RemoteOp::REPLAY_WEIGHTED:
+      if (!Planned) {
+        std::cerr << "ERROR: Remote guide client replayed choices that "
+                     "weren't planned, disconnecting it\n\n";
+        return;
+      }
+      if (!S.get64(N) || badChoices(Op == (uint8_t)RemoteOp::REPLAY_WEIGHTED))
+        return;
+      Weights.clear();
+      if (Op == (uint8_t)RemoteOp::REPLAY_WEIGHTED) {
+        Weights.resize(N);
+        for (auto &W : Weights) {
+          uint64_t Bits;
+          if (!S.get64(Bits))
+            return;
+          std::memcpy(&W, &Bits, sizeof(W));
+        }
+      }
+      if (!S.get64(Choice))
+        return;
+      if (Choice >= N ||
+          (Replayed < Prefix.size() && Choice != Prefix[Replayed])) {
+        std::cerr << "ERROR: Remote guide client replayed an impossible "
+                     "choice, disconnecting it\n\n";
+        return;
+      }
+      if (wrongShape(Weights))
+        return;
+      ++Replayed;
+      C->replay(N, Weights, Choice);
+      break;
+    default:
+      std::cerr << "ERROR: Remote guide client sent unknown request " << (int)Op
+                << ", disconnecting it\n\n";
+      return;
+    }
+  }
+}
+
+class RemoteChooser;
+class RemoteBatchChooser;
+
+class RemoteGuide : public Guide {
+  friend RemoteChooser;
+  friend RemoteBatchChooser;
+  const std::string Address;
+  std::unique_ptr<RemoteStream> S;
+  std::mt19937_64 Rand;
+  bool Live = false, Batched = true;
+
+  [[noreturn]] inline void lost();
+
+public:
+  inline RemoteGuide(const std::string &_Address, uint64_t Seed);
+  inline RemoteGuide(const std::string &_Address)
+      : RemoteGuide(_Address, std::random_device{}()) {}
+  inline ~RemoteGuide() {}
+  inline std::unique_ptr<Chooser> makeChooser() override;
+  // ask for every choice to be made by the server
+  inline void setInteractive() { Batched = false; }
+  inline const std::string name() override { return "remote"; }
+};
+
+class RemoteChooser : public Chooser {
+  RemoteGuide &G;
+
+  inline uint64_t answer();
+
+public:
+  inline RemoteChooser(RemoteGuide &_G) : G(_G) {}
+  inline ~RemoteChooser() {
+    G.S->put8((uint8_t)RemoteOp::END);
+    G.S->flush();
+    G.Live = false;
+  }
+  inline uint64_t choose(uint64_t Choices) override;
+  inline bool flip() override { return choose(2); }
+  inline uint64_t chooseWeighted(const std::vector<double> &) override;
+  inline uint64_t chooseWeighted(const std::vector<uint64_t> &) override;
+  inline uint64_t chooseUnimportant() override { return fullRange(G.Rand); }
+  inline void beginScope() override {
+    G.S->put8((uint8_t)RemoteOp::BEGIN_SCOPE);
+  }
+  inline void endScope() override { G.S->put8((uint8_t)RemoteOp::END_SCOPE); }
+};
+
+class RemoteBatchChooser : public Chooser {
+  friend RemoteGuide;
+  RemoteGuide &G;
+  std::mt19937_64 Rand;
+  // the server's planned choices, in reverse order so we can pop them
+  std::vector<uint64_t> Prefix;
+  // send the log once this much of it has piled up
+  static const size_t LogChunk = 1 << 16;
+
+  template <typename RandomChoice>
+  inline uint64_t next(uint64_t Choices, RandomChoice &&randomChoice);
+  inline void log(uint64_t Choices, const std::vector<double> *Weights,
+                  uint64_t Choice);
+
+public:
+  inline RemoteBatchChooser(RemoteGuide &_G, uint64_t Seed)
+      : G(_G), Rand(Seed) {}
+  inline ~RemoteBatchChooser() {
+    G.S->put8((uint8_t)RemoteOp::END);
+    G.S->flush();
+    G.Live = false;
+  }
+  inline uint64_t choose(uint64_t Choices) override;
+  inline bool flip() override { return choose(2); }
+  inline uint64_t chooseWeighted(const std::vector<double> &) override;
+  inline uint64_t chooseWeighted(const std::vector<uint64_t> &) override;
+  inline uint64_t chooseUnimportant() override { return fullRange(Rand); }
+  inline void beginScope() override {
+    G.S->put8((uint8_t)RemoteOp::BEGIN_SCOPE);
+  }
+  inline void endScope() override { G.S->put8((uint8_t)RemoteOp::END_SCOPE); }
+};
+
+RemoteGuide::RemoteGuide(const std::string &_Address, uint64_t Seed)
+    : Address(_Address), Rand(Seed) {
+  struct addrinfo *AI;
+  struct sockaddr_un Unix;
+  if (!remoteAddress(Address, false, &AI, Unix))
+    exit(-1);
+  int FD = -1;
+  if (AI == nullptr) {
+    FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD >= 0 && connect(FD, (struct sockaddr *)&Unix, sizeof(Unix)) != 0) {
+      close(FD);
+      FD = -1;
+    }
+  } else {
+    for (auto *P = AI; P && FD < 0; P = P->ai_next) {
+      FD = socket(P->ai_family, P->ai_socktype, P->ai_protocol);
+      if (FD >= 0 && connect(FD, P->ai_addr, P->ai_addrlen) != 0) {
+        close(FD);
+        FD = -1;
+      }
+    }
+    freeaddrinfo(AI);
+    if (FD >= 0)
+      remoteNoDelay(FD);
+  }
+  if (FD < 0) {
+    std::cerr << "FATAL ERROR: Cannot connect to guide server at '" << Address
+              << "'\n\n";
+    exit(-1);
+  }
+  S = std::make_unique<RemoteStream>(FD);
+}
+
+void RemoteGuide::lost() {
+  std::cerr << "FATAL ERROR: Lost connection to guide server at '" << Address
+            << "'\n\n";
+  exit(-1);
+}
+
+std::unique_ptr<Chooser> RemoteGuide::makeChooser() {
+  assert(!Live);
+  if (!Batched) {
+    uint8_t Ok;
+    S->put8((uint8_t)RemoteOp::BEGIN);
+    if (!S->get8(Ok))
+      lost();
+    if (!Ok)
+      return nullptr;
+    Live = true;
+    return std::make_unique<RemoteChooser>(*this);
+  }
+
+  uint8_t Reply;
+  S->put8((uint8_t)RemoteOp::BATCH);
+  if (!S->get8(Reply))
+    lost();
+  switch ((RemoteBatch)Reply) {
+  case RemoteBatch::NONE:
+    return nullptr;
+  case RemoteBatch::INTERACTIVE:
+    // this server's guide can't plan, so don't bother asking again
+    Batched = false;
+    Live = true;
+    return std::make_unique<RemoteChooser>(*this);
+  case RemoteBatch::READY:
+    break;
+  default:
+    lost();
+  }
+  uint64_t Seed, N;
+  if (!S->get64(Seed) || !S->get64(N))
+    lost();
+  auto C = std::make_unique<RemoteBatchChooser>(*this, Seed);
+  C->Prefix.resize(N);
+  for (uint64_t i = 0; i < N; ++i)
+    if (!S->get64(C->Prefix[N - 1 - i]))
+      lost();
+  Live = true;
+  return C;
+}
+
+uint64_t RemoteChooser::answer() {
+  uint64_t Choice;
+  if (!G.S->get64(Choice))
+    G.lost();
+  return Choice;
+}
+
+uint64_t RemoteChooser::choose(uint64_t Choices) {
+  remoteCheckChoices(Choices, false);
+  G.S->put8((uint8_t)RemoteOp::CHOOSE);
+  G.S->put64(Choices);
+  return answer();
+}
+
+uint64_t RemoteChooser::chooseWeighted(const std::vector<double> &Probs) {
+  remoteCheckChoices(Probs.size(), true);
+  G.S->put8((uint8_t)RemoteOp::WEIGHTED);
+  G.S->put64(Probs.size());
+  for (auto P : Probs) {
+    uint64_t Bits;
+    std::memcpy(&Bits, &P, sizeof(Bits));
+    G.S->put64(Bits);
+  }
+  return answer();
+}
+
+uint64_t RemoteChooser::chooseWeighted(const std::vector<uint64_t> &Probs) {
+  remoteCheckChoices(Probs.size(), true);
+  G.S->put8((uint8_t)RemoteOp::WEIGHTED_INT);
+  G.S->put64(Probs.size());
+  for (auto P : Probs)
+    G.S->put64(P);
+  return answer();
+}
+
+template <typename RandomChoice>
+uint64_t RemoteBatchChooser::next(uint64_t Choices,
+                                  RandomChoice &&randomChoice) {
+  if (Prefix.empty())
+    return randomChoice();
+  auto Choice = Prefix.back();
+  Prefix.pop_back();
+  if (Choice >= Choices) {
+    std::cerr << "FATAL ERROR: Reached same node again, but different "
+                 "number of choices this time\n\n";
+    exit(-1);
+  }
+  return Choice;
+}
+
+void RemoteBatchChooser::log(uint64_t Choices,
+                             const std::vector<double> *Weights,
+                             uint64_t Choice) {
+  G.S->put8(Weights ? (uint8_t)RemoteOp::REPLAY_WEIGHTED
+                    : (uint8_t)RemoteOp::REPLAY);
+  G.S->put64(Choices);
+  if (Weights) {
+    for (auto W : *Weights) {
+      uint64_t Bits;
+      std::memcpy(&Bits, &W, sizeof(Bits));
+      G.S->put64(Bits);
+    }
+  }
+  G.S->put64(Choice);
+  if (G.S->pending() >= LogChunk && !G.S->flush())
+    G.lost();
+}
+
+uint64_t RemoteBatchChooser::choose(uint64_t Choices) {
+  remoteCheckChoices(Choices, false);
+  auto Choice = next(Choices, [&]() -> uint64_t {
+    std::uniform_int_distribution<uint64_t> Dist(0, Choices - 1);
+    return Dist(Rand);
+  });
+  log(Choices, nullptr, Choice);
+  return Choice;
+}
+
+uint64_t RemoteBatchChooser::chooseWeighted(const std::vector<double> &Probs) {
+  remoteCheckChoices(Probs.size(), true);
+  auto Choice = next(Probs.size(), [&]() -> uint64_t {
+    std::discrete_distribution<uint64_t> Discrete(Probs.begin(), Probs.end());
+    return Discrete(Rand);
+  });
+  log(Probs.size(), &Probs, Choice);
+  return Choice;
+}
+
+uint64_t
+RemoteBatchChooser::chooseWeighted(const std::vector<uint64_t> &Probs) {
+  std::vector<double> V(Probs.begin(), Probs.end());
+  return chooseWeighted(V);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * persistent generators: rather than starting the generator over for
+ * every choice sequence that it wants turned into a test case, a
+ * driver such as the AFL++ custom mutator starts a GeneratorProcess
+ * once and hands it one sequence after another
+ *
+ * the driver and the generator share a file made with memfd_create(),
+ * which holds the test case followed by the choice sequence, so that
+ * the driver can use the test case where it lies. they talk over a
+ * socket only to say that these are ready. the driver passes both
+ * descriptors in the FILEGUIDE_PERSISTENT_FD and FILEGUIDE_PERSISTENT_SHM
+ * environment variables. a generator that supports this mode checks
+ * for a PersistentGenerator that is active() at startup, and if there
+ * is one, calls serve() with a function that generates a test case
+ * from a FileGuide, the way it would have after reading the sequence
+ * from a file. serve() returns when the driver goes away
+ *
+ * a request gives the size of the shared file, the room set aside for
+ * the test case at its start, and the offset and number of the recs
+ * that follow. the answer is the length of the test case, which is
+ * cut off if it doesn't fit in its room
+ */
+
+static const char *const PersistentFDVar = "FILEGUIDE_PERSISTENT_FD";
+static const char *const PersistentShmVar = "FILEGUIDE_PERSISTENT_SHM";
+
+// a shared mapping of a whole file, which only ever grows
+class SharedFile {
+  int FD;
+  char *Base = nullptr;
+  size_t Size = 0;
+
+public:
+  inline SharedFile(int _FD) : FD(_FD) {}
+  SharedFile(const SharedFile &) = delete;
+  SharedFile &operator=(const SharedFile &) = delete;
+  inline ~SharedFile() {
+    if (Base)
+      munmap(Base, Size);
+    close(FD);
+  }
+  inline int fd() { return FD; }
+  inline char *data() { return Base; }
+  inline size_t size() { return Size; }
+  // map at least NewSize bytes, first growing the file if Grow is set
+  inline bool map(size_t NewSize, bool Grow);
+};
+
+bool SharedFile::map(size_t NewSize, bool Grow) {
+  if (NewSize <= Size)
+    return true;
+  if (Grow && ftruncate(FD, NewSize) != 0)
+    return false;
+  if (Base)
+    munmap(Base, Size);
+  Size = 0;
+  auto *P = mmap(nullptr, NewSize, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+  if (P == MAP_FAILED) {
+    Base = nullptr;
+    return false;
+  }
+  Base = (char *)P;
+  Size = NewSize;
+  return true;
+}
+
+class PersistentGenerator {
+  std::unique_ptr<RemoteStream> S;
+  std::unique_ptr<SharedFile> Shared;
+
+public:
+  inline PersistentGenerator() {
+    auto *FD = getenv(PersistentFDVar);
+    auto *Shm = getenv(PersistentShmVar);
+    if (FD && Shm) {
+      S = std::make_unique<RemoteStream>(atoi(FD));
+      Shared = std::make_unique<SharedFile>(atoi(Shm));
+    }
+  }
+  inline bool active() { return S != nullptr; }
+  // Generate is called as Generate(FileGuide &, std::string &Output)
+  template <typename Generate> inline void serve(Generate &&generate);
+};
+
+template <typename Generate>
+void PersistentGenerator::serve(Generate &&generate) {
+  assert(active());
+  FileGuide FG;
+  std::string Output;
+  uint64_t Size, Room, At, N;
+  while (S->get64(Size) && S->get64(Room) && S->get64(At) && S->get64(N)) {
+    if (!Shared->map(Size, false) || At % alignof(rec) != 0 || At < Room ||
+        At > Size || N > (Size - At) / sizeof(rec)) {
+      std::cerr << "FATAL ERROR: Bad request from persistent generator "
+                   "driver\n\n";
+      return;
+    }
+    auto *Recs = (const rec *)(Shared->data() + At);
+    FG.getChoices().assign(Recs, Recs + N);
+    Output.clear();
+    generate(FG, Output);
+    std::memcpy(Shared->data(), Output.data(),
+                std::min<uint64_t>(Output.size(), Room));
+    S->put64(Output.size());
+    if (!S->flush())
+      return;
+  }
+}
+
+class GeneratorProcess {
+  pid_t Pid = -1;
+  std::unique_ptr<RemoteStream> S;
+  std::unique_ptr<SharedFile> Shared;
+  const size_t Room, ChoicesAt;
+
+public:
+  inline GeneratorProcess(const std::string &Path, size_t MaxLen);
+  GeneratorProcess(const GeneratorProcess &) = delete;
+  GeneratorProcess &operator=(const GeneratorProcess &) = delete;
+  inline ~GeneratorProcess();
+  /*
+   * run the generator on Choices; Out is left pointing at the test
+   * case, cut off at MaxLen bytes, which stays valid until the next
+   * run. returns false if the generator died
+   */
+  inline bool run(const std::vector<rec> &Choices, const char *&Out,
+                  size_t &Len);
+};
+
+GeneratorProcess::GeneratorProcess(const std::string &Path, size_t MaxLen)
+    : Room(MaxLen),
+      ChoicesAt((MaxLen + alignof(rec) - 1) / alignof(rec) * alignof(rec)) {
+  int FDs[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, FDs) != 0) {
+    std::cerr << "FATAL ERROR: socketpair failed: " << strerror(errno)
+              << "\n\n";
+    exit(-1);
+  }
+  int Shm = memfd_create("tree-guide", MFD_CLOEXEC);
+  if (Shm < 0) {
+    std::cerr << "FATAL ERROR: memfd_create failed: " << strerror(errno)
+              << "\n\n";
+    exit(-1);
+  }
+  Shared = std::make_unique<SharedFile>(Shm);
+  if (!Shared->map(ChoicesAt + 4096 * sizeof(rec), true)) {
+    std::cerr << "FATAL ERROR: couldn't map shared memory: " << strerror(errno)
+              << "\n\n";
+    exit(-1);
+  }
+  Pid = fork();
+  if (Pid == -1) {
+    std::cerr << "FATAL ERROR: fork failed: " << strerror(errno) << "\n\n";
+    exit(-1);
+  }
+  if (Pid == 0) {
+    // dup() leaves the generator's descriptors open across the exec
+    auto Var1 =
+        std::string(PersistentFDVar) + "=" + std::to_string(dup(FDs[1]));
+    auto Var2 = std::string(PersistentShmVar) + "=" + std::to_string(dup(Shm));
+    char *argv[] = {(char *)Path.c_str(), nullptr};
+    char *envp[] = {(char *)Var1.c_str(), (char *)Var2.c_str(), nullptr};
+    execve(Path.c_str(), argv, envp);
+    std::cerr << "FATAL ERROR: couldn't run generator '" << Path
+              << "': " << strerror(errno) << "\n\n";
+    _exit(-1);
+  }
+  close(FDs[1]);
+  S = std::make_unique<RemoteStream>(FDs[0]);
+}
+
+GeneratorProcess::~GeneratorProcess() {
+  // the generator exits once it sees the socket close
+  S.reset();
+  int Status;
+  while (waitpid(Pid, &Status, 0) < 0 && errno == EINTR)
+    ;
+}
+
+bool GeneratorProcess::run(const std::vector<rec> &Choices, const char *&Out,
+                           size_t &Len) {
+  auto Need = ChoicesAt + Choices.size() * sizeof(rec);
+  if (Need > Shared->size() &&
+      !Shared->map(std::max(Need, 2 * Shared->size()), true)) {
+    std::cerr << "FATAL ERROR: couldn't grow shared memory: "
+              << strerror(errno) << "\n\n";
+    exit(-1);
+  }
+  std::memcpy(Shared->data() + ChoicesAt, Choices.data(),
+              Choices.size() * sizeof(rec));
+  S->put64(Shared->size());
+  S->put64(Room);
+  S->put64(ChoicesAt);
+  S->put64(Choices.size());
+  uint64_t N;
+  if (!S->get64(N))
+    return false;
+  Out = Shared->data();
+  Len = std::min<uint64_t>(N, Room);
+  return true;
+}
+
+/*
+ * generator plugins: a generator that is safe to run inside its
+ * driver's process can be built as a shared object that exports
+ *
+ *   extern "C" void tree_guide_generate(tree_guide::FileGuide &,
+ *                                       std::string &Output);
+ *
+ * which does what a persistent generator's serve() callback does. the
+ * driver loads it with a GeneratorPlugin and calls it directly, with
+ * no process or file in between. since C++ types cross this boundary,
+ * the plugin has to be built against the same guide.h and C++ library
+ * as the driver
  */
 
-// TODO
+static const char *const GeneratorEntry = "tree_guide_generate";
+
+class GeneratorPlugin {
+  void *Handle;
+  void (*Generate)(FileGuide &, std::string &);
+
+public:
+  inline GeneratorPlugin(const std::string &Path);
+  GeneratorPlugin(const GeneratorPlugin &) = delete;
+  GeneratorPlugin &operator=(const GeneratorPlugin &) = delete;
+  inline ~GeneratorPlugin() { dlclose(Handle); }
+  inline void run(FileGuide &G, std::string &Output) {
+    Output.clear();
+    Generate(G, Output);
+  }
+};
+
+GeneratorPlugin::GeneratorPlugin(const std::string &Path) {
+  Handle = dlopen(Path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!Handle) {
+    std::cerr << "FATAL ERROR: couldn't load generator plugin: " << dlerror()
+              << "\n\n";
+    exit(-1);
+  }
+  Generate = (void (*)(FileGuide &, std::string &))dlsym(Handle, GeneratorEntry);
+  if (!Generate) {
+    std::cerr << "FATAL ERROR: generator plugin '" << Path
+              << "' doesn't export " << GeneratorEntry << "\n\n";
+    exit(-1);
+  }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
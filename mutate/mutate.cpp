@@ -5,34 +5,306 @@ using namespace tree_guide;
 namespace mutator {
 
 /////////////////////////////////////////////////////////////////////////////////////
-// TODO
-// - lots more work on scope-aware mutations
 
 static std::unique_ptr<std::mt19937_64> Rand;
 
 void init(long Seed) { Rand = std::make_unique<std::mt19937_64>(Seed); }
 
-static void change_one(std::vector<rec> &C) {
+static uint64_t pick(uint64_t n) {
+  std::uniform_int_distribution<uint64_t> Dist(0, n - 1);
+  return Dist(*Rand.get());
+}
+
+/*
+ * a scope in a choice sequence: C[Begin] is its START and C[End] is the
+ * matching END. Parent is the index of the enclosing scope in the
+ * index's list of scopes, or NoParent for a scope at the top level,
+ * whose Depth is 0
+ */
+struct Scope {
+  size_t Begin, End, Parent, Depth;
+};
+
+static const size_t NoParent = std::numeric_limits<size_t>::max();
+
+/*
+ * the shape of a choice sequence, found in one pass so that mutations
+ * can pick a numeric choice, a scope, or a scope's sibling without
+ * searching for it. mutations that move scopes around make the index
+ * stale, and it gets rebuilt before the next mutation that needs it
+ */
+class ScopeIndex {
+  // the children of scope i are Kids[KidsBegin[i] .. KidsBegin[i + 1]),
+  // in order; the top-level scopes come after everyone else's children
+  std::vector<size_t> Kids, KidsBegin;
+  // where each scope is in its parent's list of children
+  std::vector<size_t> KidPos;
+  // the scopes at depth d are ByDepth[DepthBegin[d] .. DepthBegin[d + 1])
+  std::vector<size_t> ByDepth, DepthBegin;
+  std::vector<size_t> Open, NewIndex;
+
+public:
+  // every complete scope, in order of their STARTs
+  std::vector<Scope> Scopes;
+  // the position of every numeric choice
+  std::vector<size_t> Nums;
+  bool Valid = false;
+
+  void build(const std::vector<rec> &C);
+
+  // how many siblings come after scope i
+  size_t laterSiblings(size_t i) const {
+    auto P = Scopes[i].Parent == NoParent ? Scopes.size() : Scopes[i].Parent;
+    return KidsBegin[P + 1] - KidsBegin[P] - KidPos[i] - 1;
+  }
+
+  // the n'th sibling after scope i, counting from 0
+  size_t laterSibling(size_t i, size_t n) const {
+    auto P = Scopes[i].Parent == NoParent ? Scopes.size() : Scopes[i].Parent;
+    return Kids[KidsBegin[P] + KidPos[i] + 1 + n];
+  }
+
+  // how many scopes are at depth d
+  size_t atDepth(size_t d) const {
+    return d + 1 < DepthBegin.size() ? DepthBegin[d + 1] - DepthBegin[d] : 0;
+  }
+
+  // the n'th scope at depth d, counting from 0
+  size_t nthAtDepth(size_t d, size_t n) const {
+    return ByDepth[DepthBegin[d] + n];
+  }
+
+  // how many numeric choices scope S contains
+  size_t numsIn(const Scope &S) const {
+    return std::upper_bound(Nums.begin(), Nums.end(), S.End) -
+           std::lower_bound(Nums.begin(), Nums.end(), S.Begin);
+  }
+};
+
+/*
+ * a mutated sequence can be cut off, so a START without an END, or an
+ * END without a START, just isn't part of any scope
+ */
+void ScopeIndex::build(const std::vector<rec> &C) {
+  Scopes.clear();
+  Nums.clear();
+  Open.clear();
+  for (size_t i = 0; i < C.size(); ++i) {
+    if (C[i].k == RecKind::START) {
+      auto Parent = Open.empty() ? NoParent : Open.back();
+      Scopes.push_back({i, NoParent, Parent, 0});
+      Open.push_back(Scopes.size() - 1);
+    } else if (C[i].k == RecKind::END && !Open.empty()) {
+      Scopes[Open.back()].End = i;
+      Open.pop_back();
+    } else if (C[i].k == RecKind::NUM) {
+      Nums.push_back(i);
+    }
+  }
+
+  // an unclosed scope is dropped, and so is everything nested inside it
+  NewIndex.assign(Scopes.size(), NoParent);
+  size_t N = 0;
+  for (size_t i = 0; i < Scopes.size(); ++i) {
+    auto S = Scopes[i];
+    if (S.End == NoParent ||
+        (S.Parent != NoParent && NewIndex[S.Parent] == NoParent))
+      continue;
+    if (S.Parent != NoParent) {
+      S.Parent = NewIndex[S.Parent];
+      S.Depth = Scopes[S.Parent].Depth + 1;
+    }
+    NewIndex[i] = N;
+    Scopes[N++] = S;
+  }
+  Scopes.resize(N);
+
+  // group the scopes by parent; a counting sort keeps siblings in order
+  KidsBegin.assign(N + 2, 0);
+  for (auto &S : Scopes)
+    ++KidsBegin[(S.Parent == NoParent ? N : S.Parent) + 1];
+  for (size_t i = 1; i < KidsBegin.size(); ++i)
+    KidsBegin[i] += KidsBegin[i - 1];
+  Kids.resize(N);
+  KidPos.resize(N);
+  Open.assign(KidsBegin.begin(), KidsBegin.end() - 1);
+  for (size_t i = 0; i < N; ++i) {
+    auto P = Scopes[i].Parent == NoParent ? N : Scopes[i].Parent;
+    KidPos[i] = Open[P] - KidsBegin[P];
+    Kids[Open[P]++] = i;
+  }
+
+  // and the same again by depth
+  size_t MaxDepth = 0;
+  for (auto &S : Scopes)
+    MaxDepth = std::max(MaxDepth, S.Depth);
+  DepthBegin.assign(MaxDepth + 2, 0);
+  for (auto &S : Scopes)
+    ++DepthBegin[S.Depth + 1];
+  for (size_t i = 1; i < DepthBegin.size(); ++i)
+    DepthBegin[i] += DepthBegin[i - 1];
+  ByDepth.resize(N);
+  Open.assign(DepthBegin.begin(), DepthBegin.end() - 1);
+  for (size_t i = 0; i < N; ++i)
+    ByDepth[Open[Scopes[i].Depth]++] = i;
+  Valid = true;
+}
+
+// reused from one call to the next, along with their storage
+static ScopeIndex Index, DonorIndex;
+
+// replace a numeric choice with anything at all
+static bool change_one(std::vector<rec> &C) {
+  if (Index.Nums.empty())
+    return false;
   std::uniform_int_distribution<uint64_t> FullDist(
       std::numeric_limits<uint64_t>::min(),
       std::numeric_limits<uint64_t>::max());
-  std::uniform_int_distribution<uint64_t> LimitedDist(0, C.size() - 1);
-  uint64_t x;
-  // this could perform poorly if a choice sequence is almost entirely
-  // scope changes, or loop infinitely if there aren't any numeric
-  // choices, we'll deal with that when it happens
-  do {
-    x = LimitedDist(*Rand.get());
-  } while (C.at(x).k != RecKind::NUM);
-  C.at(x).v = FullDist(*Rand.get());
+  C[Index.Nums[pick(Index.Nums.size())]].v = FullDist(*Rand.get());
+  return true;
 }
 
-void mutate_choices(std::vector<rec> &C) {
-  std::uniform_int_distribution<uint64_t> CoinDist(0, 1);
+/*
+ * nudge a numeric choice up or down a little; generators mostly make
+ * small choices, and a neighboring value is often a neighboring
+ * alternative
+ */
+static bool tweak_one(std::vector<rec> &C) {
+  if (Index.Nums.empty())
+    return false;
+  const uint64_t MaxDelta = 8;
+  auto Delta = 1 + pick(MaxDelta);
+  auto &r = C[Index.Nums[pick(Index.Nums.size())]];
+  // wrapping around is fine: the generator reduces it modulo its range
+  r.v = pick(2) ? r.v + Delta : r.v - Delta;
+  return true;
+}
+
+/*
+ * a top-level scope that spans the whole sequence is usually the one
+ * the generator wraps around everything; removing or replacing it
+ * throws away the entire test case
+ */
+static bool wholeSequence(const Scope &S, const std::vector<rec> &C) {
+  return S.Depth == 0 && S.Begin == 0 && S.End + 1 == C.size();
+}
+
+/*
+ * remove a scope and everything in it, unless that leaves no numeric
+ * choices at all, and then nothing is left to mutate
+ */
+static bool delete_scope(std::vector<rec> &C) {
+  if (Index.Scopes.empty())
+    return false;
+  auto S = Index.Scopes[pick(Index.Scopes.size())];
+  if (wholeSequence(S, C) || Index.numsIn(S) == Index.Nums.size())
+    return false;
+  C.erase(C.begin() + S.Begin, C.begin() + S.End + 1);
+  Index.Valid = false;
+  return true;
+}
+
+// repeat a scope right after itself
+static bool duplicate_scope(std::vector<rec> &C) {
+  if (Index.Scopes.empty())
+    return false;
+  auto S = Index.Scopes[pick(Index.Scopes.size())];
+  std::vector<rec> Copy(C.begin() + S.Begin, C.begin() + S.End + 1);
+  C.insert(C.begin() + S.End + 1, Copy.begin(), Copy.end());
+  Index.Valid = false;
+  return true;
+}
+
+// exchange a scope with a later scope that has the same parent
+static bool swap_siblings(std::vector<rec> &C) {
+  if (Index.Scopes.empty())
+    return false;
+  auto A = pick(Index.Scopes.size());
+  auto Later = Index.laterSiblings(A);
+  if (Later == 0)
+    return false;
+  auto &S1 = Index.Scopes[A];
+  auto &S2 = Index.Scopes[Index.laterSibling(A, pick(Later))];
+  // S1 Mid S2 -> Mid S2 S1 -> S2 Mid S1
+  auto First = C.begin() + S1.Begin;
+  auto Len1 = S1.End + 1 - S1.Begin;
+  auto Len2 = S2.End + 1 - S2.Begin;
+  auto LenMid = S2.Begin - (S1.End + 1);
+  std::rotate(First, First + Len1, C.begin() + S2.End + 1);
+  std::rotate(First, First + LenMid, First + LenMid + Len2);
+  Index.Valid = false;
+  return true;
+}
+
+/*
+ * replace a scope with one from the same depth of another choice
+ * sequence; scopes at the same depth were most likely made by the same
+ * part of the generator, so the donated choices mean something similar
+ * where they land. replacing a scope around everything would just
+ * swap in the donor, so that one stays
+ */
+static bool splice_scope(std::vector<rec> &C, const std::vector<rec> &Donor) {
+  if (Index.Scopes.empty())
+    return false;
+  auto S = Index.Scopes[pick(Index.Scopes.size())];
+  if (wholeSequence(S, C))
+    return false;
+  auto Count = DonorIndex.atDepth(S.Depth);
+  if (Count == 0)
+    return false;
+  auto D = DonorIndex.Scopes[DonorIndex.nthAtDepth(S.Depth, pick(Count))];
+  if (Index.numsIn(S) == Index.Nums.size() && DonorIndex.numsIn(D) == 0)
+    return false;
+  C.erase(C.begin() + S.Begin, C.begin() + S.End + 1);
+  C.insert(C.begin() + S.Begin, Donor.begin() + D.Begin,
+           Donor.begin() + D.End + 1);
+  Index.Valid = false;
+  return true;
+}
+
+/*
+ * try one randomly chosen mutation; it doesn't apply if the sequence
+ * lacks what it needs, such as a scope to delete
+ */
+static bool mutate_one(std::vector<rec> &C, const std::vector<rec> *Donor) {
+  switch (pick(Donor ? 6 : 5)) {
+  case 0:
+    return change_one(C);
+  case 1:
+    return tweak_one(C);
+  case 2:
+    return delete_scope(C);
+  case 3:
+    return duplicate_scope(C);
+  case 4:
+    return swap_siblings(C);
+  case 5:
+    return splice_scope(C, *Donor);
+  default:
+    assert(false);
+    return false;
+  }
+}
+
+static void mutate(std::vector<rec> &C, const std::vector<rec> *Donor) {
+  const int MaxTries = 10;
+  Index.Valid = false;
+  if (Donor)
+    DonorIndex.build(*Donor);
   do {
-    change_one(C);
-  } while (CoinDist(*Rand.get()) == 0);
+    for (int Tries = 0; Tries < MaxTries; ++Tries) {
+      if (!Index.Valid)
+        Index.build(C);
+      if (mutate_one(C, Donor))
+        break;
+    }
+  } while (pick(2) == 0);
 }
 
-} // end namespace mutator
+void mutate_choices(std::vector<rec> &C) { mutate(C, nullptr); }
+
+void mutate_choices(std::vector<rec> &C, const std::vector<rec> &Donor) {
+  mutate(C, &Donor);
+}
 
+} // end namespace mutator
@@ -1,8 +1,21 @@
 #include "guide.h"
 
 namespace mutator {
-  
+
 void init(long Seed);
+
+/*
+ * apply one or more random mutations to a choice sequence: changing or
+ * nudging numeric choices, and deleting, duplicating, or swapping whole
+ * scopes. a sequence whose scopes are balanced stays balanced
+ */
 void mutate_choices(std::vector<tree_guide::rec> &C);
 
+/*
+ * the same, but a scope from Donor can also be spliced into C, in place
+ * of a scope at the same depth
+ */
+void mutate_choices(std::vector<tree_guide::rec> &C,
+                    const std::vector<tree_guide::rec> &Donor);
+
 };
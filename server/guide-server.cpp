@@ -0,0 +1,78 @@
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "guide.h"
+
+/*
+ * serves one guide to remote generators; see the remote guide section
+ * of guide.h. with a snapshot file, the tree is restored from it at
+ * startup if it exists, and saved to it after SIGINT or SIGTERM
+ */
+
+using namespace std;
+using namespace tree_guide;
+
+static GuideServer *Server;
+
+// stop() only sets a flag and shuts down the listening socket, which is
+// safe in a signal handler; serve() hangs up on the clients itself
+static void handleSignal(int) { Server->stop(); }
+
+[[noreturn]] static void usage() {
+  cerr << "usage: guide-server <bfs|weighted|sharded> <host:port|unix:/path> "
+          "[snapshot]\n";
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4)
+    usage();
+  string Kind = argv[1], Address = argv[2];
+  string Snapshot = argc > 3 ? argv[3] : "";
+
+  unique_ptr<BFSGuide> BFS;
+  unique_ptr<WeightedSamplerGuide> Weighted;
+  unique_ptr<ShardedGuide> Sharded;
+  Guide *G;
+  if (Kind == "bfs") {
+    BFS = make_unique<BFSGuide>();
+    G = BFS.get();
+  } else if (Kind == "weighted") {
+    Weighted = make_unique<WeightedSamplerGuide>(random_device{}());
+    G = Weighted.get();
+  } else if (Kind == "sharded") {
+    if (!Snapshot.empty()) {
+      cerr << "FATAL ERROR: The sharded guide does not support snapshots\n\n";
+      exit(-1);
+    }
+    Sharded = make_unique<ShardedGuide>(random_device{}());
+    G = Sharded.get();
+  } else {
+    usage();
+  }
+
+  if (!Snapshot.empty() && ifstream(Snapshot).good()) {
+    bool Ok = BFS ? BFS->loadSnapshot(Snapshot)
+                  : Weighted->loadSnapshot(Snapshot);
+    if (!Ok)
+      exit(-1);
+  }
+
+  GuideServer S(*G, Address);
+  Server = &S;
+  signal(SIGINT, handleSignal);
+  signal(SIGTERM, handleSignal);
+  cerr << "serving " << G->name() << " guide on " << Address << "\n";
+  S.serve();
+
+  if (!Snapshot.empty()) {
+    bool Ok = BFS ? BFS->saveSnapshot(Snapshot)
+                  : Weighted->saveSnapshot(Snapshot);
+    if (!Ok)
+      exit(-1);
+  }
+  return 0;
+}
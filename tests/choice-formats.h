@@ -0,0 +1,233 @@
+/*
+ * saved choices, including scopes and values at the edges of what the
+ * formats can hold, come back unchanged from both formats
+ */
+
+static std::vector<tree_guide::rec> edgeChoices() {
+  using tree_guide::RecKind;
+  std::vector<tree_guide::rec> Recs;
+  Recs.push_back({RecKind::START, 0});
+  for (uint64_t V : {(uint64_t)0, (uint64_t)1, (uint64_t)127, (uint64_t)128,
+                     (uint64_t)1 << 62, (uint64_t)1 << 63,
+                     (uint64_t)-3, (uint64_t)-2, (uint64_t)-1})
+    Recs.push_back({RecKind::NUM, V});
+  Recs.push_back({RecKind::START, 0});
+  Recs.push_back({RecKind::END, 0});
+  Recs.push_back({RecKind::END, 0});
+  return Recs;
+}
+
+static void requireSameChoices(const std::vector<tree_guide::rec> &A,
+                               const std::vector<tree_guide::rec> &B) {
+  REQUIRE(A.size() == B.size());
+  for (size_t i = 0; i < A.size(); ++i) {
+    REQUIRE(A[i].k == B[i].k);
+    if (A[i].k == tree_guide::RecKind::NUM)
+      REQUIRE(A[i].v == B[i].v);
+  }
+}
+
+TEST_CASE("Binary choices round-trip") {
+  auto Recs = edgeChoices();
+  std::string Bin;
+  tree_guide::encodeChoices(Recs, Bin);
+  // even with the largest values, this beats the in-memory recs
+  REQUIRE(Bin.size() < Recs.size() * sizeof(tree_guide::rec));
+
+  SECTION("From memory") {
+    tree_guide::FileGuide FG;
+    REQUIRE(FG.parseChoices(Bin.data(), Bin.size(), "// "));
+    requireSameChoices(FG.getChoices(), Recs);
+  }
+
+  SECTION("From a stream") {
+    std::stringstream SS(Bin);
+    tree_guide::FileGuide FG;
+    REQUIRE(FG.parseChoices(SS, "// "));
+    requireSameChoices(FG.getChoices(), Recs);
+  }
+
+  SECTION("Truncated") {
+    std::string Big;
+    tree_guide::encodeChoices({{tree_guide::RecKind::NUM, (uint64_t)-1}}, Big);
+    std::vector<tree_guide::rec> Out;
+    REQUIRE(tree_guide::decodeChoices(Big.data(), Big.size(), Out));
+    REQUIRE(!tree_guide::decodeChoices(Big.data(), Big.size() - 1, Out));
+  }
+}
+
+TEST_CASE("Binary and text choices agree") {
+  tree_guide::DefaultGuide G;
+  tree_guide::SaverGuide SG(&G, "# ");
+  for (int rep = 0; rep < 100; ++rep) {
+    auto C = SG.makeChooser();
+    auto SC = static_cast<tree_guide::SaverChooser *>(C.get());
+    uint64_t NumLeaves;
+    SC->beginScope();
+    test_increasing_degree_tree(*SC, NumLeaves);
+    SC->chooseUnimportant();
+    SC->endScope();
+    auto Text = SC->formatChoices();
+    auto Bin = SC->encodeChoices();
+    tree_guide::FileGuide FromText, FromBin;
+    REQUIRE(FromText.parseChoices(Text.data(), Text.size(), "# "));
+    REQUIRE(FromBin.parseChoices(Bin.data(), Bin.size(), "# "));
+    requireSameChoices(FromText.getChoices(), SC->unpackChoices());
+    requireSameChoices(FromBin.getChoices(), SC->unpackChoices());
+  }
+}
+
+/*
+ * the text parser takes the whole range of uint64_t but nothing past
+ * it, and refuses items it can't make sense of
+ */
+
+TEST_CASE("Text choices are checked") {
+  auto parse = [](const std::string &Items) {
+    std::string Text = "// " + tree_guide::StartMarker + "\n// " + Items +
+                       "\n// " + tree_guide::EndMarker + "\n";
+    tree_guide::FileGuide FG;
+    bool OK = FG.parseChoices(Text.data(), Text.size(), "// ");
+    return std::make_pair(OK, FG.getChoices());
+  };
+
+  auto [OK, Recs] = parse("{,18446744073709551615,0,},");
+  REQUIRE(OK);
+  REQUIRE(Recs.size() == 4);
+  REQUIRE(Recs[1].v == UINT64_MAX);
+  REQUIRE(Recs[2].v == 0);
+
+  REQUIRE(!parse("18446744073709551616,").first);
+  REQUIRE(!parse("99999999999999999999999,").first);
+  REQUIRE(!parse("1,,2,").first);
+  REQUIRE(!parse("-1,").first);
+  REQUIRE(!parse("1;2,").first);
+  REQUIRE(!parse("{1,").first);
+}
+
+/*
+ * a quiet file guide still rejects what it can't parse, but says
+ * nothing about it
+ */
+
+TEST_CASE("Quiet parsing") {
+  std::stringstream Errors;
+  auto *Old = std::cerr.rdbuf(Errors.rdbuf());
+  tree_guide::FileGuide FG;
+  FG.setQuiet(true);
+  std::string Text = "// " + tree_guide::StartMarker + "\n// 1;2,\n";
+  std::string Bin = tree_guide::BinaryChoiceMagic + "\x7f";
+  bool TextOK = FG.parseChoices(Text.data(), Text.size(), "// ");
+  bool BinOK = FG.parseChoices(Bin.data(), Bin.size(), "// ");
+  std::cerr.rdbuf(Old);
+  REQUIRE(!TextOK);
+  REQUIRE(!BinOK);
+  REQUIRE(Errors.str().empty());
+}
+
+/*
+ * a saver guide hands each chooser's buffers on to the next one, so
+ * recording doesn't have to allocate once it has warmed up
+ */
+
+TEST_CASE("Saver reuses its buffers") {
+  tree_guide::DefaultGuide G;
+  tree_guide::SaverGuide SG(&G, "// ");
+  {
+    auto C = SG.makeChooser();
+    for (int i = 0; i < 1000; ++i)
+      C->choose(10);
+  }
+  auto C = SG.makeChooser();
+  auto &Packed = static_cast<tree_guide::SaverChooser *>(C.get())
+                     ->getPackedChoices();
+  REQUIRE(Packed.Values.empty());
+  REQUIRE(Packed.Values.capacity() >= 1000);
+}
+
+/*
+ * a streaming file guide makes the same choices as one that parses the
+ * whole file first, whether the file can be mapped or has to be read
+ * from a pipe
+ */
+
+TEST_CASE("Streaming choices") {
+  char Template[] = "/tmp/streaming-choices-test-XXXXXX";
+  int TempFD = mkstemp(Template);
+  REQUIRE(TempFD >= 0);
+  close(TempFD);
+  const std::string FileName = Template;
+  struct Remover {
+    const std::string &Name;
+    ~Remover() { std::remove(Name.c_str()); }
+  } RemoveFile{FileName};
+  tree_guide::DefaultGuide G;
+  tree_guide::SaverGuide SG(&G, "// ");
+  auto C = SG.makeChooser();
+  auto SC = static_cast<tree_guide::SaverChooser *>(C.get());
+  std::vector<uint64_t> Made;
+  for (int i = 0; i < 20000; ++i) {
+    if (i % 100 == 0)
+      SC->beginScope();
+    Made.push_back(SC->choose(1000));
+    if (i % 100 == 99)
+      SC->endScope();
+  }
+
+  // returns whether the file guide made the same choices
+  auto replay = [&](tree_guide::FileGuide &FG) {
+    auto FC = FG.makeChooser();
+    for (int i = 0; i < 20000; ++i) {
+      if (i % 100 == 0)
+        FC->beginScope();
+      if (FC->choose(1000) != Made[i])
+        return false;
+      if (i % 100 == 99)
+        FC->endScope();
+    }
+    return true;
+  };
+
+  for (auto Binary : {false, true}) {
+    auto Data = Binary ? SC->encodeChoices()
+                       : "generated output\n" + SC->formatChoices();
+
+    SECTION(Binary ? "Mapped binary file" : "Mapped text file") {
+      {
+        std::ofstream Out(FileName, std::ios::binary);
+        Out << Data;
+      }
+      tree_guide::FileGuide FG;
+      REQUIRE(FG.streamChoices(FileName, "// "));
+      REQUIRE(replay(FG));
+    }
+
+    SECTION(Binary ? "Binary pipe" : "Text pipe") {
+      int FDs[2];
+      REQUIRE(pipe(FDs) == 0);
+      // Catch2's assertions can't be used off the main thread, so the
+      // writer just says whether it managed to write everything
+      bool Wrote = true;
+      std::thread Writer([&]() {
+        // small writes, so that records straddle reads
+        for (size_t i = 0; i < Data.size() && Wrote; i += 1000)
+          Wrote = write(FDs[1], Data.data() + i,
+                        std::min<size_t>(1000, Data.size() - i)) > 0;
+        close(FDs[1]);
+      });
+      tree_guide::FileGuide FG;
+      auto Same =
+          FG.streamChoices("/dev/fd/" + std::to_string(FDs[0]), "// ") &&
+          replay(FG);
+      // read whatever the guide didn't, so the writer can't be stuck
+      // when we join it
+      char Rest[4096];
+      while (read(FDs[0], Rest, sizeof(Rest)) > 0)
+        ;
+      Writer.join();
+      close(FDs[0]);
+      REQUIRE(Wrote);
+      REQUIRE(Same);
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "gen_regex.h"
+
+/*
+ * measures the average cost of one choose() call while the BFS guide
+ * drives the regex generator. the counting wrapper costs the same
+ * virtual call in every configuration, so differences between runs are
+ * differences in the guide
+ */
+
+const long N = 200000;
+
+using namespace std;
+using namespace tree_guide;
+
+class CountingChooser : public Chooser {
+  Chooser &C;
+
+public:
+  uint64_t Count = 0;
+  CountingChooser(Chooser &_C) : C(_C) {}
+  uint64_t choose(uint64_t n) override {
+    ++Count;
+    return C.choose(n);
+  }
+  bool flip() override {
+    ++Count;
+    return C.flip();
+  }
+  uint64_t chooseWeighted(const vector<double> &P) override {
+    ++Count;
+    return C.chooseWeighted(P);
+  }
+  uint64_t chooseWeighted(const vector<uint64_t> &P) override {
+    ++Count;
+    return C.chooseWeighted(P);
+  }
+  uint64_t chooseUnimportant() override { return C.chooseUnimportant(); }
+  void beginScope() override { C.beginScope(); }
+  void endScope() override { C.endScope(); }
+};
+
+int main(int argc, char *argv[]) {
+  long Reps = argc > 1 ? atol(argv[1]) : N;
+  BFSGuide G(0);
+  uint64_t Choices = 0;
+  auto Start = chrono::steady_clock::now();
+  for (long i = 0; i < Reps; ++i) {
+    auto C = G.makeChooser();
+    if (!C)
+      break;
+    CountingChooser CC(*C);
+    gen(CC, RegexDepth);
+    Choices += CC.Count;
+  }
+  auto Elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() -
+                                                Start)
+                     .count();
+  cout << Choices << " choices in " << Elapsed / 1e6 << " ms, "
+       << Elapsed / Choices << " ns per choice\n";
+  return 0;
+}
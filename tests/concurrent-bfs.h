@@ -0,0 +1,52 @@
+#include <thread>
+
+/*
+ * several threads share one BFS guide; between them they should still
+ * reach every leaf, and the guide should only report that the tree is
+ * exhausted once they have
+ */
+
+template <typename F> std::vector<int> exploreConcurrently(F Tree) {
+  const int THREADS = 8;
+  tree_guide::BFSGuide G;
+  std::mutex Lock;
+  std::vector<int> Results;
+  uint64_t NumLeaves = 0;
+  std::vector<std::thread> Workers;
+  for (int t = 0; t < THREADS; ++t) {
+    Workers.emplace_back([&]() {
+      while (true) {
+        auto C = G.makeChooser();
+        if (!C)
+          break;
+        uint64_t N;
+        auto Res = Tree(*C, N);
+        C.reset();
+        std::lock_guard<std::mutex> Guard(Lock);
+        NumLeaves = N;
+        if (Res >= Results.size())
+          Results.resize(Res + 1);
+        ++Results.at(Res);
+      }
+    });
+  }
+  for (auto &W : Workers)
+    W.join();
+  REQUIRE((size_t)NumLeaves == Results.size());
+  return Results;
+}
+
+TEST_CASE("Concurrent BFS discovers every leaf exactly once") {
+  SECTION("full tree") {
+    for (auto Count : exploreConcurrently(test_full_tree))
+      REQUIRE(Count == 1);
+  }
+  SECTION("maximally unbalanced") {
+    for (auto Count : exploreConcurrently(test_maximally_unbalanced))
+      REQUIRE(Count == 1);
+  }
+  SECTION("increasing degree tree") {
+    for (auto Count : exploreConcurrently(test_increasing_degree_tree))
+      REQUIRE(Count == 1);
+  }
+}
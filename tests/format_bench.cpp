@@ -0,0 +1,80 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "guide.h"
+
+/*
+ * measures the cost of writing a saved chooser's choices out and
+ * reading them back in, in both the text and the binary formats. every
+ * hundredth choice opens a scope, so scope markers get exercised too
+ */
+
+const long N = 1000000;
+
+using namespace std;
+using namespace tree_guide;
+
+static double msSince(chrono::steady_clock::time_point Start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - Start)
+      .count();
+}
+
+static void check(const vector<rec> &A, const vector<rec> &B) {
+  bool Same = A.size() == B.size();
+  for (size_t i = 0; Same && i < A.size(); ++i)
+    Same = A[i].k == B[i].k && (A[i].k != RecKind::NUM || A[i].v == B[i].v);
+  if (!Same) {
+    cerr << "FATAL ERROR: choices didn't survive the round trip\n\n";
+    exit(-1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long Reps = argc > 1 ? atol(argv[1]) : N;
+  DefaultGuide G;
+  SaverGuide SG(&G, "// ");
+  auto C = SG.makeChooser();
+  auto SC = static_cast<SaverChooser *>(C.get());
+  for (long i = 0; i < Reps; ++i) {
+    if (i % 100 == 0)
+      SC->beginScope();
+    // mostly small choices, with the occasional full-width one
+    if (i % 10 == 0)
+      SC->chooseUnimportant();
+    else
+      SC->choose(1000);
+    if (i % 100 == 99)
+      SC->endScope();
+  }
+  auto &Choices = SC->unpackChoices();
+
+  auto Start = chrono::steady_clock::now();
+  auto Text = SC->formatChoices();
+  auto FormatMs = msSince(Start);
+  FileGuide FromText;
+  Start = chrono::steady_clock::now();
+  if (!FromText.parseChoices(Text.data(), Text.size(), "// "))
+    exit(-1);
+  auto ParseMs = msSince(Start);
+  check(FromText.getChoices(), Choices);
+
+  Start = chrono::steady_clock::now();
+  auto Bin = SC->encodeChoices();
+  auto EncodeMs = msSince(Start);
+  vector<rec> FromBin;
+  Start = chrono::steady_clock::now();
+  if (!decodeChoices(Bin.data(), Bin.size(), FromBin))
+    exit(-1);
+  auto DecodeMs = msSince(Start);
+  check(FromBin, Choices);
+
+  cout << Choices.size() << " records\n";
+  cout << "text:   " << Text.size() << " bytes, format " << FormatMs
+       << " ms, parse " << ParseMs << " ms\n";
+  cout << "binary: " << Bin.size() << " bytes, encode " << EncodeMs
+       << " ms, decode " << DecodeMs << " ms\n";
+  return 0;
+}
@@ -0,0 +1,54 @@
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "gen_regex.h"
+
+/*
+ * this program is both ends of the persistent generator protocol: run
+ * normally, it starts a copy of itself as a persistent generator and
+ * checks that the copy makes the same test cases from saved choices
+ * as were made when the choices were saved
+ */
+
+const long N = 300;
+const long MaxLen = 4096;
+
+using namespace std;
+using namespace tree_guide;
+
+int main() {
+  PersistentGenerator PG;
+  if (PG.active()) {
+    PG.serve([](FileGuide &G, string &Output) {
+      auto C = G.makeChooser();
+      Output = gen(*C, RegexDepth);
+    });
+    return 0;
+  }
+
+  DefaultGuide G1;
+  SaverGuide G2(&G1, "// ");
+  GeneratorProcess Gen("/proc/self/exe", MaxLen);
+  int pass = 0;
+  for (int i = 0; i < N; ++i) {
+    auto C1 = G2.makeChooser();
+    auto C2 = static_cast<SaverChooser *>(C1.get());
+    assert(C2);
+    auto Str = gen(*C2, RegexDepth);
+    const char *Out;
+    size_t Len;
+    if (!Gen.run(C2->unpackChoices(), Out, Len)) {
+      cerr << "generator died\n";
+      exit(-1);
+    }
+    if (string(Out, Len) != Str.substr(0, MaxLen)) {
+      cerr << "mismatch: " << Str << "\n";
+      exit(-1);
+    }
+    ++pass;
+  }
+  cout << pass << " tests passed.\n";
+}
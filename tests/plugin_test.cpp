@@ -0,0 +1,44 @@
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "gen_regex.h"
+
+/*
+ * load the regex generator as a plugin and check that it makes the
+ * same test cases from saved choices as were made when the choices
+ * were saved
+ */
+
+const long N = 300;
+
+using namespace std;
+using namespace tree_guide;
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " plugin.so\n";
+    return -1;
+  }
+  GeneratorPlugin Plugin(argv[1]);
+  DefaultGuide G1;
+  SaverGuide G2(&G1, "// ");
+  FileGuide FG;
+  string Output;
+  int pass = 0;
+  for (int i = 0; i < N; ++i) {
+    auto C1 = G2.makeChooser();
+    auto C2 = static_cast<SaverChooser *>(C1.get());
+    assert(C2);
+    auto Str = gen(*C2, RegexDepth);
+    FG.replaceChoices(C2->unpackChoices());
+    Plugin.run(FG, Output);
+    if (Output != Str) {
+      cerr << "mismatch: " << Str << "\n";
+      exit(-1);
+    }
+    ++pass;
+  }
+  cout << pass << " tests passed.\n";
+}
@@ -0,0 +1,9 @@
+#include "gen_regex.h"
+
+// the regex generator, packaged as a generator plugin
+
+extern "C" void tree_guide_generate(tree_guide::FileGuide &G,
+                                    std::string &Output) {
+  auto C = G.makeChooser();
+  Output = gen(*C, RegexDepth);
+}
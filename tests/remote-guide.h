@@ -0,0 +1,371 @@
+/*
+ * several clients, each with its own connection, share one BFS guide
+ * living in a server; between them they should reach every leaf
+ * exactly once, and then all be told that the tree is exhausted
+ */
+
+TEST_CASE("Remote clients share one BFS guide") {
+  const std::string Address = "unix:remote-guide-test.sock";
+  const int CLIENTS = 4;
+  bool Interactive = false;
+  SECTION("Batched") {}
+  SECTION("Interactive") { Interactive = true; }
+  tree_guide::BFSGuide G(0);
+  tree_guide::GuideServer Server(G, Address);
+  std::thread ServerThread([&]() { Server.serve(); });
+
+  std::mutex Lock;
+  std::vector<int> Results;
+  uint64_t NumLeaves = 0;
+  std::vector<std::thread> Clients;
+  for (int t = 0; t < CLIENTS; ++t) {
+    Clients.emplace_back([&]() {
+      tree_guide::RemoteGuide RG(Address);
+      if (Interactive)
+        RG.setInteractive();
+      while (true) {
+        auto C = RG.makeChooser();
+        if (!C)
+          break;
+        uint64_t N;
+        C->beginScope();
+        auto Res = test_increasing_degree_tree(*C, N);
+        C->endScope();
+        C.reset();
+        std::lock_guard<std::mutex> Guard(Lock);
+        NumLeaves = N;
+        if (Res >= Results.size())
+          Results.resize(Res + 1);
+        ++Results.at(Res);
+      }
+    });
+  }
+  for (auto &C : Clients)
+    C.join();
+  Server.stop();
+  ServerThread.join();
+
+  REQUIRE((size_t)NumLeaves == Results.size());
+  for (auto Count : Results)
+    REQUIRE(Count == 1);
+}
+
+/*
+ * a weighted sampler learns the tree from the choices that a batched
+ * client replays to it just as well as from its own
+ */
+
+TEST_CASE("Remote weighted sampler learns from batched clients") {
+  const std::string Address = "unix:remote-guide-test.sock";
+  tree_guide::WeightedSamplerGuide G(0);
+  tree_guide::GuideServer Server(G, Address);
+  std::thread ServerThread([&]() { Server.serve(); });
+  uint64_t NumLeaves;
+  {
+    tree_guide::RemoteGuide RG(Address);
+    for (int rep = 0; rep < 5000; ++rep) {
+      auto C = RG.makeChooser();
+      test_maximally_unbalanced(*C, NumLeaves);
+    }
+  }
+  // the server finishes replaying a client's log before its session,
+  // and then serve(), can end
+  Server.stop();
+  ServerThread.join();
+  // the server's seeds are random, so the estimate's rounding can vary
+  REQUIRE(G.sizeEstimate() > NumLeaves - 1e-6);
+  REQUIRE(G.sizeEstimate() < NumLeaves + 1e-6);
+}
+
+TEST_CASE("Remote weighted choices") {
+  const std::string Address = "unix:remote-guide-test.sock";
+  tree_guide::DefaultGuide G(0);
+  tree_guide::GuideServer Server(G, Address);
+  std::thread ServerThread([&]() { Server.serve(); });
+  {
+    tree_guide::RemoteGuide RG(Address);
+    for (int rep = 0; rep < 100; ++rep) {
+      auto C = RG.makeChooser();
+      REQUIRE(C->chooseWeighted(std::vector<double>{0.0, 1.0, 0.0}) == 1);
+      REQUIRE(C->chooseWeighted(std::vector<uint64_t>{0, 0, 5}) == 2);
+      REQUIRE(C->choose(1) == 0);
+    }
+  }
+  Server.stop();
+  ServerThread.join();
+}
+
+/*
+ * a client that asks for an impossible choice is disconnected, rather
+ * than taking the server down, and everyone else carries on
+ */
+
+TEST_CASE("Remote guide server disconnects malformed clients") {
+  const std::string Path = "remote-guide-test.sock";
+  tree_guide::DefaultGuide G(0);
+  tree_guide::GuideServer Server(G, "unix:" + Path);
+  std::thread ServerThread([&]() { Server.serve(); });
+  // start a traversal and make one raw request; returns whether the
+  // server hung up on us instead of answering
+  auto hungUp = [&](tree_guide::RemoteOp Op, uint64_t N) {
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un Unix;
+    std::memset(&Unix, 0, sizeof(Unix));
+    Unix.sun_family = AF_UNIX;
+    std::strcpy(Unix.sun_path, Path.c_str());
+    REQUIRE(connect(FD, (struct sockaddr *)&Unix, sizeof(Unix)) == 0);
+    tree_guide::RemoteStream S(FD);
+    uint8_t Ok;
+    S.put8((uint8_t)tree_guide::RemoteOp::BEGIN);
+    REQUIRE(S.get8(Ok));
+    REQUIRE(Ok);
+    S.put8((uint8_t)Op);
+    S.put64(N);
+    uint64_t Answer;
+    return !S.get64(Answer);
+  };
+  REQUIRE(hungUp(tree_guide::RemoteOp::WEIGHTED, (uint64_t)1 << 60));
+  REQUIRE(hungUp(tree_guide::RemoteOp::WEIGHTED_INT, UINT64_MAX));
+  REQUIRE(hungUp(tree_guide::RemoteOp::CHOOSE, 0));
+  // DefaultGuide's choosers don't plan, so there's nothing to replay
+  REQUIRE(hungUp(tree_guide::RemoteOp::REPLAY, 2));
+  REQUIRE(!hungUp(tree_guide::RemoteOp::CHOOSE, 3));
+  {
+    tree_guide::RemoteGuide RG("unix:" + Path);
+    auto C = RG.makeChooser();
+    REQUIRE(C->choose(3) < 3);
+  }
+  Server.stop();
+  ServerThread.join();
+}
+
+/*
+ * a batched client can't make the server allocate whatever it likes
+ * by replaying a weighted choice among a huge number of options
+ */
+
+TEST_CASE("Remote guide server bounds replayed weighted choices") {
+  const std::string Path = "remote-guide-test.sock";
+  tree_guide::WeightedSamplerGuide G(0);
+  tree_guide::GuideServer Server(G, "unix:" + Path);
+  std::thread ServerThread([&]() { Server.serve(); });
+  int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un Unix;
+  std::memset(&Unix, 0, sizeof(Unix));
+  Unix.sun_family = AF_UNIX;
+  std::strcpy(Unix.sun_path, Path.c_str());
+  REQUIRE(connect(FD, (struct sockaddr *)&Unix, sizeof(Unix)) == 0);
+  {
+    tree_guide::RemoteStream S(FD);
+    uint8_t Ready;
+    uint64_t Seed, Len, P;
+    S.put8((uint8_t)tree_guide::RemoteOp::BATCH);
+    REQUIRE(S.get8(Ready));
+    REQUIRE(Ready == (uint8_t)tree_guide::RemoteBatch::READY);
+    REQUIRE(S.get64(Seed));
+    REQUIRE(S.get64(Len));
+    for (uint64_t i = 0; i < Len; ++i)
+      REQUIRE(S.get64(P));
+    S.put8((uint8_t)tree_guide::RemoteOp::REPLAY_WEIGHTED);
+    S.put64((uint64_t)1 << 60);
+    REQUIRE(!S.get8(Ready));
+  }
+  Server.stop();
+  ServerThread.join();
+}
+
+/*
+ * a client that goes away in the middle of a traversal hasn't found a
+ * leaf, so the guide must not learn one from it: BFS still reaches
+ * every leaf exactly once, and the weighted sampler still gets the
+ * size of the tree right
+ */
+
+TEST_CASE("Remote guide server discards abandoned traversals") {
+  const std::string Path = "remote-guide-test.sock";
+  bool BFS = false;
+  std::unique_ptr<tree_guide::Guide> G;
+  SECTION("BFS") {
+    BFS = true;
+    G = std::make_unique<tree_guide::BFSGuide>(0);
+  }
+  SECTION("Weighted sampler") {
+    G = std::make_unique<tree_guide::WeightedSamplerGuide>(0);
+  }
+  tree_guide::GuideServer Server(*G, "unix:" + Path);
+  std::thread ServerThread([&]() { Server.serve(); });
+  // make the first choice of a traversal and then hang up; after a
+  // malformed request, the server hangs up on us instead
+  auto abandon = [&](bool Malformed) {
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un Unix;
+    std::memset(&Unix, 0, sizeof(Unix));
+    Unix.sun_family = AF_UNIX;
+    std::strcpy(Unix.sun_path, Path.c_str());
+    REQUIRE(connect(FD, (struct sockaddr *)&Unix, sizeof(Unix)) == 0);
+    tree_guide::RemoteStream S(FD);
+    uint8_t Ok;
+    uint64_t Answer;
+    S.put8((uint8_t)tree_guide::RemoteOp::BEGIN);
+    REQUIRE(S.get8(Ok));
+    REQUIRE(Ok);
+    S.put8((uint8_t)tree_guide::RemoteOp::CHOOSE);
+    S.put64(3);
+    REQUIRE(S.get64(Answer));
+    if (Malformed) {
+      S.put8((uint8_t)tree_guide::RemoteOp::CHOOSE);
+      S.put64(0);
+      REQUIRE(!S.get64(Answer));
+    }
+  };
+  for (int i = 0; i < 3; ++i)
+    abandon(i % 2);
+  std::vector<int> Results(6);
+  {
+    tree_guide::RemoteGuide RG("unix:" + Path);
+    for (int rep = 0; rep < (BFS ? 100 : 2000); ++rep) {
+      auto C = RG.makeChooser();
+      if (!C)
+        break;
+      auto A = C->choose(3);
+      ++Results.at(A * 2 + C->choose(2));
+      if (rep % 100 == 0)
+        abandon(rep % 200 == 0);
+    }
+  }
+  Server.stop();
+  ServerThread.join();
+  if (BFS) {
+    for (auto Count : Results)
+      REQUIRE(Count == 1);
+  } else {
+    auto &WS = static_cast<tree_guide::WeightedSamplerGuide &>(*G);
+    REQUIRE(WS.sizeEstimate() > 6 - 1e-6);
+    REQUIRE(WS.sizeEstimate() < 6 + 1e-6);
+  }
+}
+
+/*
+ * stopping the server hangs up on clients that are still connected,
+ * rather than waiting for them to go away by themselves
+ */
+
+TEST_CASE("Stopping a remote guide server hangs up on idle clients") {
+  const std::string Path = "remote-guide-test.sock";
+  tree_guide::BFSGuide G(0);
+  tree_guide::GuideServer Server(G, "unix:" + Path);
+  std::thread ServerThread([&]() { Server.serve(); });
+  int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un Unix;
+  std::memset(&Unix, 0, sizeof(Unix));
+  Unix.sun_family = AF_UNIX;
+  std::strcpy(Unix.sun_path, Path.c_str());
+  REQUIRE(connect(FD, (struct sockaddr *)&Unix, sizeof(Unix)) == 0);
+  tree_guide::RemoteStream S(FD);
+  uint8_t Ok;
+  S.put8((uint8_t)tree_guide::RemoteOp::BEGIN);
+  REQUIRE(S.get8(Ok));
+  REQUIRE(Ok);
+  Server.stop();
+  ServerThread.join();
+  REQUIRE(!S.get8(Ok));
+}
+
+/*
+ * a client whose choices don't fit what the guide already knows about
+ * the tree is disconnected, instead of the guide exiting or building a
+ * tree that contradicts itself, and everyone else carries on
+ */
+
+TEST_CASE("Remote guide server drops clients that contradict the tree") {
+  const std::string Path = "remote-guide-test.sock";
+  bool BFS = false;
+  std::unique_ptr<tree_guide::Guide> G;
+  SECTION("BFS") {
+    BFS = true;
+    G = std::make_unique<tree_guide::BFSGuide>(0);
+  }
+  SECTION("Weighted sampler") {
+    G = std::make_unique<tree_guide::WeightedSamplerGuide>(0);
+  }
+  tree_guide::GuideServer Server(*G, "unix:" + Path);
+  std::thread ServerThread([&]() { Server.serve(); });
+  auto connectRaw = [&]() {
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un Unix;
+    std::memset(&Unix, 0, sizeof(Unix));
+    Unix.sun_family = AF_UNIX;
+    std::strcpy(Unix.sun_path, Path.c_str());
+    REQUIRE(connect(FD, (struct sockaddr *)&Unix, sizeof(Unix)) == 0);
+    return std::make_unique<tree_guide::RemoteStream>(FD);
+  };
+  // the tree is a choice among 2 and then among 3
+  std::vector<int> Results(6);
+  tree_guide::RemoteGuide RG("unix:" + Path);
+  auto traverse = [&]() {
+    auto C = RG.makeChooser();
+    if (!C)
+      return false;
+    auto A = C->choose(2);
+    ++Results.at(A * 3 + C->choose(3));
+    return true;
+  };
+  REQUIRE(traverse());
+
+  uint8_t Byte;
+  uint64_t Word;
+  {
+    // a different number of options at the root
+    auto S = connectRaw();
+    S->put8((uint8_t)tree_guide::RemoteOp::BEGIN);
+    REQUIRE(S->get8(Byte));
+    REQUIRE(Byte);
+    S->put8((uint8_t)tree_guide::RemoteOp::CHOOSE);
+    S->put64(5);
+    REQUIRE(!S->get64(Word));
+  }
+  {
+    // a leaf where the tree has a choice
+    auto S = connectRaw();
+    S->put8((uint8_t)tree_guide::RemoteOp::BEGIN);
+    REQUIRE(S->get8(Byte));
+    REQUIRE(Byte);
+    S->put8((uint8_t)tree_guide::RemoteOp::END);
+    S->put8((uint8_t)tree_guide::RemoteOp::BEGIN);
+    REQUIRE(!S->get8(Byte));
+  }
+  {
+    // a batched client replaying a different number of options
+    auto S = connectRaw();
+    std::vector<uint64_t> Prefix;
+    S->put8((uint8_t)tree_guide::RemoteOp::BATCH);
+    REQUIRE(S->get8(Byte));
+    REQUIRE(Byte == (uint8_t)tree_guide::RemoteBatch::READY);
+    REQUIRE(S->get64(Word));
+    REQUIRE(S->get64(Word));
+    Prefix.resize(Word);
+    for (auto &P : Prefix)
+      REQUIRE(S->get64(P));
+    S->put8((uint8_t)tree_guide::RemoteOp::REPLAY);
+    S->put64(5);
+    S->put64(Prefix.empty() ? 4 : Prefix[0]);
+    S->put8((uint8_t)tree_guide::RemoteOp::END);
+    S->put8((uint8_t)tree_guide::RemoteOp::BATCH);
+    REQUIRE(!S->get8(Byte));
+  }
+
+  // the server is still there, and its tree is still the right shape
+  for (int rep = 0; rep < (BFS ? 100 : 2000); ++rep)
+    if (!traverse())
+      break;
+  Server.stop();
+  ServerThread.join();
+  if (BFS) {
+    for (auto Count : Results)
+      REQUIRE(Count == 1);
+  } else {
+    auto &WS = static_cast<tree_guide::WeightedSamplerGuide &>(*G);
+    REQUIRE(WS.sizeEstimate() > 6 - 1e-6);
+    REQUIRE(WS.sizeEstimate() < 6 + 1e-6);
+  }
+}
@@ -65,6 +65,15 @@ int use_choices() {
     if (VERBOSE)
       cout << "generated " << Str << "\n";
     assert(Str == Generated.at(i));
+
+    // the same choices, parsed from memory
+    ifstream in(FNs.at(i));
+    string Text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    FileGuide G2;
+    if (!G2.parseChoices(Text.data(), Text.size(), Prefix))
+      exit(-1);
+    auto C2 = G2.makeChooser();
+    assert(gen(*C2, Depth) == Generated.at(i));
     ++pass;
     if (!KEEP)
       remove(FNs.at(i).c_str());
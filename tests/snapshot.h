@@ -0,0 +1,154 @@
+#include <cstdio>
+
+/*
+ * a guide restored from a snapshot should carry on exactly where the
+ * saved one left off
+ */
+
+TEST_CASE("BFS snapshots resume exploration") {
+  const std::string FileName = "bfs-snapshot.tgsnap";
+  uint64_t NumLeaves;
+  std::vector<int> Seen;
+  auto run = [&](tree_guide::BFSGuide &G, int Reps) {
+    for (int rep = 0; rep < Reps; ++rep) {
+      auto C = G.makeChooser();
+      if (!C)
+        break;
+      auto Leaf = test_increasing_degree_tree(*C, NumLeaves);
+      Seen.resize(NumLeaves);
+      ++Seen.at(Leaf);
+    }
+  };
+
+  {
+    tree_guide::BFSGuide G(1);
+    run(G, 20);
+    REQUIRE(G.saveSnapshot(FileName));
+  }
+  tree_guide::BFSGuide Restored(2);
+  REQUIRE(Restored.loadSnapshot(FileName));
+  run(Restored, 1000000);
+  for (auto Count : Seen)
+    REQUIRE(Count == 1);
+  std::remove(FileName.c_str());
+}
+
+TEST_CASE("Weighted sampler snapshots restore the tree") {
+  const std::string FileName = "ws-snapshot.tgsnap";
+  uint64_t NumLeaves;
+  tree_guide::WeightedSamplerGuide G(1);
+  // a budget exercises the free lists, and a wide node the sparse
+  // tables and samplers
+  G.setMaxNodes(200);
+  for (int rep = 0; rep < 2000; ++rep) {
+    auto C = G.makeChooser();
+    if (C->choose(2))
+      test_maximally_unbalanced(*C, NumLeaves);
+    else
+      C->choose(3000);
+  }
+  REQUIRE(G.saveSnapshot(FileName));
+
+  tree_guide::WeightedSamplerGuide Restored(1);
+  Restored.setMaxNodes(200);
+  REQUIRE(Restored.loadSnapshot(FileName));
+  REQUIRE(Restored.liveNodes() == G.liveNodes());
+  REQUIRE(Restored.sizeEstimate() == G.sizeEstimate());
+
+  // both guides should now make exactly the same choices
+  for (int rep = 0; rep < 500; ++rep) {
+    auto C1 = G.makeChooser();
+    uint64_t A = C1->choose(2), B = 0;
+    if (A)
+      B = test_maximally_unbalanced(*C1, NumLeaves);
+    else
+      B = C1->choose(3000);
+    C1.reset();
+    auto C2 = Restored.makeChooser();
+    REQUIRE(C2->choose(2) == A);
+    if (A)
+      REQUIRE(test_maximally_unbalanced(*C2, NumLeaves) == B);
+    else
+      REQUIRE(C2->choose(3000) == B);
+  }
+  REQUIRE(Restored.sizeEstimate() == G.sizeEstimate());
+  std::remove(FileName.c_str());
+}
+
+TEST_CASE("Bad snapshots are rejected") {
+  const std::string FileName = "bad-snapshot.tgsnap";
+  {
+    tree_guide::BFSGuide G(1);
+    auto C = G.makeChooser();
+    C->choose(5);
+    C.reset();
+    REQUIRE(G.saveSnapshot(FileName));
+  }
+  tree_guide::WeightedSamplerGuide WrongKind;
+  REQUIRE(!WrongKind.loadSnapshot(FileName));
+  tree_guide::BFSGuide Missing;
+  REQUIRE(!Missing.loadSnapshot("no-such-snapshot.tgsnap"));
+  {
+    std::ofstream Out(FileName, std::ios::binary | std::ios::trunc);
+    Out << "not a snapshot";
+  }
+  tree_guide::BFSGuide Garbage;
+  REQUIRE(!Garbage.loadSnapshot(FileName));
+  std::remove(FileName.c_str());
+}
+
+/*
+ * a snapshot whose indices point outside its arenas must be turned
+ * away before anything follows them
+ */
+TEST_CASE("Snapshots with corrupt indices are rejected") {
+  const std::string FileName = "corrupt-snapshot.tgsnap";
+  auto poke = [&](uint64_t Offset, uint32_t Value) {
+    std::fstream F(FileName, std::ios::binary | std::ios::in | std::ios::out);
+    F.seekp(Offset);
+    F.write((const char *)&Value, sizeof(Value));
+  };
+  auto peek = [&](uint64_t Offset) {
+    std::ifstream F(FileName, std::ios::binary);
+    uint64_t X = 0;
+    F.seekg(Offset);
+    F.read((char *)&X, sizeof(X));
+    return X;
+  };
+  // magic, version, kind, then the number of scalars and the scalars
+  auto header = [&](uint64_t NumScalars) { return 24 + 8 * NumScalars; };
+
+  SECTION("BFS") {
+    {
+      tree_guide::BFSGuide G(1);
+      auto C = G.makeChooser();
+      C->choose(5);
+      C.reset();
+      REQUIRE(G.saveSnapshot(FileName));
+    }
+    // the root's only slot comes right after the nodes, which are
+    // four 32-bit fields each
+    auto Nodes = header(5);
+    auto Slots = Nodes + 16 + peek(Nodes) * 16;
+    REQUIRE((uint32_t)peek(Slots + 16) == 1);
+    poke(Slots + 16, 1000);
+    tree_guide::BFSGuide Restored;
+    REQUIRE(!Restored.loadSnapshot(FileName));
+  }
+
+  SECTION("Weighted sampler") {
+    {
+      tree_guide::WeightedSamplerGuide G(1);
+      auto C = G.makeChooser();
+      C->choose(2);
+      C.reset();
+      REQUIRE(G.saveSnapshot(FileName));
+    }
+    // the root's first inline child, in the first node record
+    auto Nodes = header(2);
+    poke(Nodes + 16 + 44, 1000);
+    tree_guide::WeightedSamplerGuide Restored;
+    REQUIRE(!Restored.loadSnapshot(FileName));
+  }
+  std::remove(FileName.c_str());
+}
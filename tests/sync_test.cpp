@@ -61,6 +61,24 @@ void printChoices(const vector<rec> &C) {
   cout << "\n\n";
 }
 
+bool hasNum(const vector<rec> &C) {
+  for (auto r : C)
+    if (r.k == RecKind::NUM)
+      return true;
+  return false;
+}
+
+bool balanced(const vector<rec> &C) {
+  long Depth = 0;
+  for (auto r : C) {
+    if (r.k == RecKind::START)
+      ++Depth;
+    if (r.k == RecKind::END && --Depth < 0)
+      return false;
+  }
+  return Depth == 0;
+}
+
 int use_choices() {
   int pass = 0;
   mutator::init(std::random_device{}());
@@ -81,7 +99,17 @@ int use_choices() {
       printChoices(Ch);
     }
 
-    mutator::mutate_choices(Ch);
+    // splice from the next test case's choices
+    FileGuide Donor;
+    stringstream d(Choices.at((i + 1) % N));
+    if (!Donor.parseChoices(d, Prefix))
+      exit(-1);
+
+    mutator::mutate_choices(Ch, Donor.getChoices());
+    if (!balanced(Ch)) {
+      cerr << "mutation unbalanced the scopes\n";
+      exit(-1);
+    }
     
     if (VERBOSE) {
       cout << "mutated choices:\n";
@@ -99,7 +127,7 @@ int use_choices() {
     if (VERBOSE)
       cout << "generated: " << Str << "\n";
 
-    auto C3 = Ch2->getChoices();
+    auto &C3 = Ch2->unpackChoices();
     
     if (VERBOSE) {
       cout << "actual choices:\n";
@@ -113,8 +141,61 @@ int use_choices() {
   return pass;
 }
 
+/*
+ * pile mutations onto the same sequence, so that mutations run on the
+ * results of other mutations, and make sure that sequences with nothing
+ * numeric in them don't hang the mutator
+ */
+int mutate_repeatedly() {
+  const int Reps = 10000;
+  const size_t MaxSize = 10000;
+  FileGuide FG, Donor;
+  stringstream s(Choices.at(N - 1)), d(Choices.at(0));
+  if (!FG.parseChoices(s, Prefix) || !Donor.parseChoices(d, Prefix))
+    exit(-1);
+  auto Ch = FG.getChoices();
+  for (int i = 0; i < Reps; ++i) {
+    mutator::mutate_choices(Ch, Donor.getChoices());
+    if (!balanced(Ch)) {
+      cerr << "repeated mutation unbalanced the scopes\n";
+      exit(-1);
+    }
+    // duplication can make a sequence grow without limit
+    if (Ch.size() > MaxSize)
+      Ch = FG.getChoices();
+  }
+  vector<rec> Empty, Scopes{{RecKind::START, 0}, {RecKind::END, 0}};
+  mutator::mutate_choices(Empty);
+  for (int i = 0; i < 100; ++i)
+    mutator::mutate_choices(Scopes);
+
+  // a scope around everything is never deleted or spliced over, and
+  // the last numeric choice never goes away
+  const vector<rec> Small{{RecKind::START, 0},
+                          {RecKind::NUM, 1},
+                          {RecKind::NUM, 2},
+                          {RecKind::END, 0}};
+  const vector<rec> NoNums{{RecKind::START, 0}, {RecKind::END, 0}};
+  Ch = Small;
+  for (int i = 0; i < Reps; ++i) {
+    if (i % 2)
+      mutator::mutate_choices(Ch);
+    else
+      mutator::mutate_choices(Ch, NoNums);
+    if (!balanced(Ch) || !hasNum(Ch) || Ch.front().k != RecKind::START) {
+      cerr << "repeated mutation lost the last numeric choice\n";
+      printChoices(Ch);
+      exit(-1);
+    }
+    if (Ch.size() > MaxSize)
+      Ch = Small;
+  }
+  return 1;
+}
+
 int main() {
   make_choices();
   auto pass = use_choices();
+  pass += mutate_repeatedly();
   cout << pass << " tests passed.\n";
 }
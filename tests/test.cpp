@@ -2,8 +2,14 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
 
+#include <sstream>
+
 #include "guide.h"
 #include "standard-trees.h"
 
+#include "choice-formats.h"
+#include "concurrent-bfs.h"
+#include "remote-guide.h"
+#include "snapshot.h"
 #include "test-standard-trees.h"
 #include "weighted-sampler.h"
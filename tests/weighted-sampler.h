@@ -87,3 +87,196 @@ TEST_CASE("Basic frequency checks") {
     REQUIRE(freq[2] >= 0.2);
   }
 }
+
+TEST_CASE("Wide nodes get fully explored") {
+  auto explore = [](uint64_t Degree) {
+    tree_guide::WeightedSamplerGuide G;
+    std::vector<bool> Seen(Degree, false);
+    uint64_t Remaining = Degree;
+    for (int rep = 0; rep < 100000 && Remaining > 0; ++rep) {
+      auto C = G.makeChooser();
+      auto i = C->choose(Degree);
+      if (!Seen.at(i)) {
+        Seen.at(i) = true;
+        --Remaining;
+      }
+    }
+    return Remaining;
+  };
+
+  SECTION("Dense children") { REQUIRE(explore(500) == 0); }
+
+  SECTION("Sparse children") { REQUIRE(explore(2000) == 0); }
+}
+
+TEST_CASE("Node budget is respected") {
+  const uint64_t MaxNodes = 40;
+  tree_guide::WeightedSamplerGuide G;
+  G.setMaxNodes(MaxNodes);
+  uint64_t NumLeaves = 0;
+  std::vector<bool> Seen;
+  for (int rep = 0; rep < 5000; ++rep) {
+    auto C = G.makeChooser();
+    auto Leaf = test_full_tree(*C, NumLeaves);
+    Seen.resize(NumLeaves);
+    Seen.at(Leaf) = true;
+    // the budget is enforced between samples, so one sample's worth of
+    // new nodes can be over it
+    REQUIRE(G.liveNodes() <= MaxNodes + 7);
+  }
+  for (auto S : Seen)
+    REQUIRE(S);
+}
+
+/*
+ * under a node budget, subtrees made of nodes of every width keep
+ * getting collapsed, and new ones keep being explored below the wide
+ * root; storage for children and weights gets reused, so once things
+ * have settled it should stop growing
+ */
+TEST_CASE("Child storage stays bounded under a node budget") {
+  const uint64_t Degrees[] = {2, 3, 5, 17, 100, 700, 1500, 5000};
+  tree_guide::WeightedSamplerGuide G;
+  G.setMaxNodes(100);
+  auto walk = [&](tree_guide::Chooser &C) {
+    auto D = Degrees[C.choose(1000000) % std::size(Degrees)];
+    for (int Level = 0; Level < 3; ++Level) {
+      // the width of each node depends on the path to it
+      uint64_t X;
+      if (Level % 2 == 0) {
+        std::vector<double> Weights(D, 1.0);
+        Weights[0] = 2.0;
+        X = C.chooseWeighted(Weights);
+      } else {
+        X = C.choose(D);
+      }
+      D = Degrees[X % std::size(Degrees)];
+    }
+  };
+  uint64_t Settled = 0;
+  for (int rep = 0; rep < 20000; ++rep) {
+    auto C = G.makeChooser();
+    walk(*C);
+    C.reset();
+    if (rep == 2000)
+      Settled = G.childStorageBytes();
+  }
+  REQUIRE(G.childStorageBytes() <= 2 * Settled);
+}
+
+/*
+ * several threads sample from one guide at once, optionally under a
+ * node budget, and between them should still see every leaf
+ */
+TEST_CASE("Concurrent sampling covers the tree") {
+  const int THREADS = 8;
+  auto explore = [&](uint64_t MaxNodes) {
+    tree_guide::WeightedSamplerGuide G;
+    G.setMaxNodes(MaxNodes);
+    std::mutex Lock;
+    uint64_t NumLeaves = 0;
+    std::vector<bool> Seen;
+    std::vector<std::thread> Workers;
+    for (int t = 0; t < THREADS; ++t) {
+      Workers.emplace_back([&]() {
+        for (int rep = 0; rep < 1000; ++rep) {
+          auto C = G.makeChooser();
+          uint64_t N;
+          auto Leaf = test_full_tree(*C, N);
+          C.reset();
+          std::lock_guard<std::mutex> Guard(Lock);
+          NumLeaves = N;
+          Seen.resize(NumLeaves);
+          Seen.at(Leaf) = true;
+        }
+      });
+    }
+    for (auto &W : Workers)
+      W.join();
+    REQUIRE(Seen.size() == NumLeaves);
+    for (auto S : Seen)
+      REQUIRE(S);
+  };
+
+  SECTION("Unbounded") { explore((uint64_t)-1); }
+
+  SECTION("Under a node budget") { explore(40); }
+}
+
+TEST_CASE("Merging trees") {
+  uint64_t NumLeaves;
+  auto train = [&](tree_guide::WeightedSamplerGuide &G, int Reps) {
+    for (int rep = 0; rep < Reps; ++rep) {
+      auto C = G.makeChooser();
+      test_maximally_unbalanced(*C, NumLeaves);
+    }
+  };
+  tree_guide::WeightedSamplerGuide A(1), B(2);
+  train(A, 100);
+  train(B, 100);
+
+  SECTION("Merging into an empty guide copies the tree") {
+    tree_guide::WeightedSamplerGuide Copy;
+    Copy.merge(A);
+    REQUIRE(Copy.liveNodes() == A.liveNodes());
+    REQUIRE(Copy.sizeEstimate() == A.sizeEstimate());
+  }
+
+  SECTION("Merging is idempotent") {
+    auto Before = std::max(A.liveNodes(), B.liveNodes());
+    A.merge(B);
+    REQUIRE(A.liveNodes() >= Before);
+    auto Nodes = A.liveNodes();
+    auto Estimate = A.sizeEstimate();
+    A.merge(B);
+    REQUIRE(A.liveNodes() == Nodes);
+    REQUIRE(A.sizeEstimate() == Estimate);
+  }
+
+  SECTION("Merging only what changed matches merging everything") {
+    tree_guide::WeightedSamplerGuide Incremental, Full;
+    auto Since = Incremental.merge(A);
+    for (int round = 0; round < 20; ++round) {
+      train(A, 10);
+      Since = Incremental.merge(A, Since);
+    }
+    Full.merge(A);
+    REQUIRE(Incremental.liveNodes() == Full.liveNodes());
+    REQUIRE(std::abs(Incremental.sizeEstimate() - Full.sizeEstimate()) <
+            1e-6 * Full.sizeEstimate());
+  }
+
+  SECTION("A merged tree keeps learning") {
+    A.merge(B);
+    train(A, 5000);
+    REQUIRE(A.sizeEstimate() == NumLeaves);
+  }
+}
+
+TEST_CASE("Sharded guide covers the tree") {
+  const int THREADS = 8;
+  tree_guide::ShardedGuide G(0, 50);
+  std::mutex Lock;
+  uint64_t NumLeaves = 0;
+  std::vector<bool> Seen;
+  std::vector<std::thread> Workers;
+  for (int t = 0; t < THREADS; ++t) {
+    Workers.emplace_back([&]() {
+      for (int rep = 0; rep < 500; ++rep) {
+        auto C = G.makeChooser();
+        uint64_t N;
+        auto Leaf = test_full_tree(*C, N);
+        C.reset();
+        std::lock_guard<std::mutex> Guard(Lock);
+        NumLeaves = N;
+        Seen.resize(NumLeaves);
+        Seen.at(Leaf) = true;
+      }
+    });
+  }
+  for (auto &W : Workers)
+    W.join();
+  for (auto S : Seen)
+    REQUIRE(S);
+  REQUIRE(G.consensus().sizeEstimate() == NumLeaves);
+}